@@ -0,0 +1,88 @@
+/*
+   Button debouncer
+
+   All buttons are debounced together with 2-bit vertical counters: a bit of
+   the debounced state only flips after 4 consecutive scans disagree with it.
+   Each button keeps its own hold time and repeat schedule, so holding UP
+   never changes how DOWN repeats.
+*/
+#pragma once
+
+#include <stdint.h>
+
+#define DEBOUNCE_MS 20
+#define BUTTON_SCAN_US (DEBOUNCE_MS * 1000 / 4) // the vertical counter needs 4 equal samples
+#define BUTTON_COUNT 6
+#define REPEAT_FIRST 1000
+#define REPEAT_INCR 255
+#define LONG_PRESS_MS REPEAT_FIRST
+#define MS_TO_SCANS(ms) ((ms) * 1000 / BUTTON_SCAN_US)
+
+struct ButtonEvents
+{
+  uint8_t pressed;
+  uint8_t released;
+  uint8_t long_pressed;
+  uint8_t repeated;
+};
+
+struct ButtonScanner
+{
+  uint8_t state; // debounced, bit set while pressed
+  uint8_t ct0, ct1;
+  uint8_t repeat_mask; // buttons that auto-repeat while held
+  uint8_t repeating;
+  uint16_t held_scans[BUTTON_COUNT];
+  uint16_t next_repeat[BUTTON_COUNT];
+};
+
+inline void button_scanner_init(ButtonScanner &scanner, uint8_t repeat_mask)
+{
+  scanner.state = 0;
+  scanner.ct0 = 0xff;
+  scanner.ct1 = 0xff;
+  scanner.repeat_mask = repeat_mask;
+  scanner.repeating = 0;
+  for (int i = 0; i < BUTTON_COUNT; i++)
+  {
+    scanner.held_scans[i] = 0;
+    scanner.next_repeat[i] = MS_TO_SCANS(REPEAT_FIRST);
+  }
+}
+
+// Takes one raw sample (bit i set while button i is down) and ORs the events
+// it causes into events. Always inlined, so it runs from the IRAM scan ISR.
+inline __attribute__((always_inline)) void button_scan(ButtonScanner &scanner, uint8_t raw, ButtonEvents &events)
+{
+  uint8_t changed = scanner.state ^ raw;
+  scanner.ct0 = ~(scanner.ct0 & changed);
+  scanner.ct1 = scanner.ct0 ^ (scanner.ct1 & changed);
+  changed &= scanner.ct0 & scanner.ct1;
+  scanner.state ^= changed;
+
+  events.pressed |= scanner.state & changed;
+  events.released |= ~scanner.state & changed;
+
+  for (int i = 0; i < BUTTON_COUNT; i++)
+  {
+    uint8_t bit = 1 << i;
+    if (!(scanner.state & bit))
+    {
+      scanner.held_scans[i] = 0;
+      scanner.next_repeat[i] = MS_TO_SCANS(REPEAT_FIRST);
+      scanner.repeating &= ~bit;
+      continue;
+    }
+
+    scanner.held_scans[i]++;
+    if (scanner.held_scans[i] == MS_TO_SCANS(LONG_PRESS_MS))
+      events.long_pressed |= bit;
+
+    if ((scanner.repeat_mask & bit) && scanner.held_scans[i] >= scanner.next_repeat[i])
+    {
+      scanner.next_repeat[i] += MS_TO_SCANS(REPEAT_INCR);
+      scanner.repeating |= bit;
+      events.repeated |= bit;
+    }
+  }
+}
@@ -0,0 +1,113 @@
+/*
+   Clock settings
+
+   The time, date and alarm being edited on the set screens, and the BCD
+   encoding of the DS3231 registers.
+*/
+#pragma once
+
+#include <stdint.h>
+
+#define CLOCK_FIRST_YEAR 2000 // the DS3231 stores two-digit years from 2000
+#define CLOCK_LAST_YEAR 2099
+
+struct ClockSettings
+{
+  struct TimeComp
+  {
+    int hour;
+    int minute;
+    int second;
+  };
+
+  struct DateComp
+  {
+    int day;
+    int month;
+    int year;
+  };
+
+  struct AlarmComp
+  {
+    int hour;
+    int minute;
+    bool active;
+  };
+
+  TimeComp time;
+  DateComp date;
+  AlarmComp alarm;
+};
+
+// The setting a set screen edits
+enum CLOCK_FIELDS
+{
+  FIELD_NONE,
+  FIELD_HOUR,
+  FIELD_MINUTE,
+  FIELD_DAY,
+  FIELD_MONTH,
+  FIELD_YEAR,
+  FIELD_ALARM_HOUR,
+  FIELD_ALARM_MINUTE,
+  FIELD_ALARM_ON_OFF,
+};
+
+inline void increase(int &number, int max, int min)
+{
+  number++;
+  if (number > max)
+    number = min;
+}
+
+inline void decrease(int &number, int max, int min)
+{
+  number--;
+  if (number < min)
+    number = max;
+}
+
+// Steps one setting up or down, wrapping around at its limits
+inline void adjust_clock_setting(ClockSettings &settings, CLOCK_FIELDS field, bool up)
+{
+  void (*step)(int &, int, int) = up ? increase : decrease;
+  switch (field)
+  {
+  case FIELD_HOUR:
+    step(settings.time.hour, 23, 0);
+    break;
+  case FIELD_MINUTE:
+    step(settings.time.minute, 59, 0);
+    break;
+  case FIELD_DAY:
+    step(settings.date.day, 31, 1);
+    break;
+  case FIELD_MONTH:
+    step(settings.date.month, 12, 1);
+    break;
+  case FIELD_YEAR:
+    step(settings.date.year, CLOCK_LAST_YEAR, CLOCK_FIRST_YEAR);
+    break;
+  case FIELD_ALARM_HOUR:
+    step(settings.alarm.hour, 23, 0);
+    break;
+  case FIELD_ALARM_MINUTE:
+    step(settings.alarm.minute, 59, 0);
+    break;
+  case FIELD_ALARM_ON_OFF:
+    settings.alarm.active = !settings.alarm.active;
+    break;
+  case FIELD_NONE:
+    break;
+  }
+}
+
+inline uint8_t dec2bcd(uint8_t val)
+{
+  return ((val / 10 * 16) + (val % 10));
+}
+
+inline uint8_t bcd2dec(uint8_t val)
+{
+  return ((val / 16 * 10) + (val % 16));
+}
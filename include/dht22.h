@@ -0,0 +1,47 @@
+/*
+   DHT22 single-wire frames
+
+   After the start pulse the DHT22 answers with 80 us low and 80 us high,
+   then 40 bits, each 50 us low followed by 26-28 us high for a 0 or 70 us
+   high for a 1: humidity and temperature in tenths, big endian, with the
+   temperature's top bit as its sign, then a checksum byte. The firmware
+   captures the pulses with the RMT peripheral; this turns their high times
+   into a record.
+*/
+#pragma once
+
+#include "sensor_record.h"
+
+#define DHT22_BITS 40
+#define DHT22_ONE_US 48 // between the 0 and 1 high times
+
+// The DHT22's quantities, in the order dht22_decode() records them
+enum DHT22_QUANTITIES : uint8_t
+{
+  DHT22_HUMIDITY,    // %
+  DHT22_TEMPERATURE, // degrees C
+};
+
+// Decodes the last DHT22_BITS of count high pulse times, in microseconds,
+// into whole percent and degrees. Anything before them, such as the
+// response pulse, is ignored. Returns false on a short read or a bad checksum.
+inline bool dht22_decode(const uint16_t *high_us, int count, SensorRecord &record)
+{
+  if (count < DHT22_BITS)
+    return false;
+  high_us += count - DHT22_BITS;
+
+  uint8_t data[DHT22_BITS / 8] = {0};
+  for (int i = 0; i < DHT22_BITS; i++)
+    data[i / 8] = data[i / 8] << 1 | (high_us[i] > DHT22_ONE_US);
+  if ((uint8_t)(data[0] + data[1] + data[2] + data[3]) != data[4])
+    return false;
+
+  int humidity = (data[0] << 8 | data[1]) / 10;
+  int temperature = ((data[2] & 0x7f) << 8 | data[3]) / 10;
+  if (data[2] & 0x80)
+    temperature = -temperature;
+  record_reading(record, DHT22_HUMIDITY, humidity);
+  record_reading(record, DHT22_TEMPERATURE, temperature);
+  return true;
+}
@@ -0,0 +1,67 @@
+/*
+   PMS7003 particulate sensor frames
+
+   The sensor sends 32-byte frames that start with 0x42 0x4d and end with a
+   16-bit sum of the bytes before it, and takes 7-byte commands in the same
+   framing to switch between active, passive and sleep modes.
+*/
+#pragma once
+
+#include "sensor_record.h"
+
+#define PM_FRAME_PREFIX 16 // header, frame length and the standard-particle readings
+#define PM_FRAME_LENGTH 32 // header, length, 13 data words and the checksum
+#define PM_COMMAND_LENGTH 7
+
+// Host commands; the data word picks the setting
+enum PMS_COMMANDS : uint8_t
+{
+  PMS_CMD_READ = 0xe2,  // send one frame in passive mode, data 0
+  PMS_CMD_MODE = 0xe1,  // data 0 passive, 1 active
+  PMS_CMD_SLEEP = 0xe4, // data 0 sleep, 1 wake up
+};
+
+// The PMS7003's quantities, in the order parse_pm_frame() records them
+enum PMS_QUANTITIES : uint8_t
+{
+  PMS_PM1,
+  PMS_PM2_5,
+  PMS_PM10,
+};
+
+// Reads PM1.0, PM2.5 and PM10 from the start of a PMS7003 frame.
+// Returns false if the frame does not start with the 0x42 0x4d header.
+inline bool parse_pm_frame(const uint8_t *frame, int length, SensorRecord &record)
+{
+  if ((length > 0 && frame[0] != 0x42) || (length > 1 && frame[1] != 0x4d))
+    return false;
+
+  if (length >= 10)
+  {
+    record_reading(record, PMS_PM1, 256 * frame[4] + frame[5]);
+    record_reading(record, PMS_PM2_5, 256 * frame[6] + frame[7]);
+    record_reading(record, PMS_PM10, 256 * frame[8] + frame[9]);
+  }
+  return true;
+}
+
+// The last word of a whole frame is the sum of every byte before it
+inline bool pm_frame_checksum_ok(const uint8_t *frame)
+{
+  uint16_t sum = 0;
+  for (int i = 0; i < PM_FRAME_LENGTH - 2; i++)
+    sum += frame[i];
+  return sum == (frame[PM_FRAME_LENGTH - 2] << 8 | frame[PM_FRAME_LENGTH - 1]);
+}
+
+// Fills command with the header, command byte, data word and the sum of
+// every byte before it
+inline void pm_command(uint8_t code, uint16_t data, uint8_t *command)
+{
+  uint8_t bytes[PM_COMMAND_LENGTH - 2] = {0x42, 0x4d, code, (uint8_t)(data >> 8), (uint8_t)data};
+  uint16_t sum = 0;
+  for (int i = 0; i < PM_COMMAND_LENGTH - 2; i++)
+    sum += command[i] = bytes[i];
+  command[PM_COMMAND_LENGTH - 2] = sum >> 8;
+  command[PM_COMMAND_LENGTH - 1] = sum;
+}
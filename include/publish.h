@@ -0,0 +1,75 @@
+/*
+   MQTT publish path
+
+   What the clock publishes and how often. It is shared by src/main.cpp and
+   tools/fleet_load.cpp, so the load generator sends exactly what a clock
+   sends.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PUBLISH_INTERVAL_S 150    // slowest publish rate, used while readings are calm
+#define PUBLISH_MIN_INTERVAL_S 30 // fastest publish rate, near a threshold or on fast change
+#define KEEP_ALIVE_INTERVAL_S 60
+#define KEEP_ALIVE_PAYLOAD "&field6=1"
+#define MQTT_RETRY_MS 500     // between connect attempts
+#define MQTT_KEEP_ALIVE_S 15  // PubSubClient default
+#define PUBLISH_PAYLOAD_SIZE 192
+
+struct PublishReadings
+{
+  int humidity;
+  int temperature;
+  int pm1;
+  int pm2_5;
+  int pm10;
+  int aqi; // -1 until the NowCast has enough data
+  int pm2_5_aqi;
+  int pm10_aqi;
+  const char *category;
+};
+
+/*
+   Publish schedule
+
+   Sensor publishes fall on a wall-clock grid, offset_ms + k * period_ms
+   milliseconds since the Unix epoch. The offset is a hash of the client ID,
+   so it survives reboots and spreads a fleet evenly across the period, even
+   when every clock powers up at the same moment.
+*/
+
+// FNV-1a, reduced to a point in the period
+inline uint32_t publish_offset_ms(const char *client_id, uint32_t period_ms)
+{
+  uint32_t hash = 2166136261u;
+  for (; *client_id; client_id++)
+    hash = (hash ^ (uint8_t)*client_id) * 16777619u;
+  return hash % period_ms;
+}
+
+// First slot on the grid strictly after after_ms
+inline uint64_t publish_slot_after(uint64_t after_ms, uint32_t period_ms, uint32_t offset_ms)
+{
+  if (after_ms < offset_ms)
+    return offset_ms;
+  return offset_ms + ((after_ms - offset_ms) / period_ms + 1) * period_ms;
+}
+
+inline int format_publish_topic(char *topic, size_t size, const char *channel_id)
+{
+  return snprintf(topic, size, "channels/%s/publish", channel_id);
+}
+
+// Fields 6 to 8 are taken, so the AQI goes into the channel status
+inline int format_sensor_payload(char *payload, size_t size, const PublishReadings &r)
+{
+  int n = snprintf(payload, size, "&field1=%d&field2=%d&field3=%d&field4=%d&field5=%d",
+                   r.humidity, r.temperature, r.pm1, r.pm2_5, r.pm10);
+  if (r.aqi >= 0 && n >= 0 && (size_t)n < size)
+    n += snprintf(payload + n, size - n, "&status=aqi:%d,pm2_5_aqi:%d,pm10_aqi:%d,category:%s",
+                  r.aqi, r.pm2_5_aqi, r.pm10_aqi, r.category);
+  return n;
+}
@@ -0,0 +1,40 @@
+/*
+   Sensor records
+
+   What a sensor driver hands to the scheduler after one conversion: the
+   quantities it measured, each by its index in the driver's own quantity
+   list and as a small integer in that quantity's unit.
+*/
+#pragma once
+
+#include <stdint.h>
+
+#define SENSOR_MAX_READINGS 4
+
+// One thing a driver measures. Each driver lists its own; the name is the
+// CSV column, JSON key and metric label, so it must be unique across drivers.
+struct QuantityInfo
+{
+  const char *name;
+  const char *unit;
+  int alert; // a reading at or above it publishes right away, 0 for none
+};
+
+// What one driver read in one conversion; only the first count readings are set
+struct SensorRecord
+{
+  uint32_t ms;
+  uint8_t driver;
+  uint8_t count;
+  struct
+  {
+    uint8_t quantity; // index in the driver's quantity list
+    int16_t value;
+  } readings[SENSOR_MAX_READINGS];
+};
+
+inline void record_reading(SensorRecord &record, uint8_t quantity, int value)
+{
+  if (record.count < SENSOR_MAX_READINGS)
+    record.readings[record.count++] = {quantity, (int16_t)value};
+}
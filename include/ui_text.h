@@ -0,0 +1,45 @@
+/*
+   UI text
+
+   Everything the screens print is a constant in flash; numbers are formatted
+   into stack buffers. Nothing here allocates, so the UI task makes no heap
+   allocations once it runs; test/test_ui_text checks that on the host.
+*/
+#pragma once
+
+#include <stdint.h>
+
+constexpr const char *DAY_NAMES[] = {"???", "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"}; // by weekday()
+constexpr const char *ON_OFF[] = {"OFF", "ON "};
+
+// Longest number format_number writes, with the sign and the terminator
+#define NUMBER_TEXT_SIZE 12
+
+inline const char *day_name(int weekday)
+{
+  return DAY_NAMES[weekday >= 1 && weekday <= 7 ? weekday : 0];
+}
+
+// Writes every digit of value, zero-padded to at least min_digits; buffer
+// needs NUMBER_TEXT_SIZE bytes
+inline char *format_number(char *buffer, int32_t value, int min_digits)
+{
+  char digits[NUMBER_TEXT_SIZE];
+  int count = 0;
+  uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+  do
+  {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  while (count < min_digits && count < NUMBER_TEXT_SIZE - 2)
+    digits[count++] = '0';
+
+  char *out = buffer;
+  if (value < 0)
+    *out++ = '-';
+  while (count)
+    *out++ = digits[--count];
+  *out = '\0';
+  return buffer;
+}
@@ -1,24 +1,52 @@
 #include <Arduino.h>
-#include <iostream>
-#include <typeinfo>
 #include <PubSubClient.h>
 #include <Wire.h>
 #include <WiFi.h>
 #include <Fsm.h>
-#include <DHT.h>
 #include <Time.h>
-#include <JC_Button.h>
 #include <DS3232RTC.h>
-#include <LiquidCrystal_I2C.h>
 #include <EEPROM.h>
 #include <SoftwareSerial.h>
+#include <soc/gpio_reg.h>
+#include <HTTPClient.h>
+#include <Update.h>
+#include <esp_ota_ops.h>
+#include <esp32/rom/miniz.h>
+#include <atomic>
+#include <esp_task_wdt.h>
+#include <esp_system.h>
+#include <LittleFS.h>
+#include <driver/rmt.h>
+#include <esp_timer.h>
 #include "secrets.h"
+#include "publish.h"
+#include "buttons.h"
+#include "ui_text.h"
+#include "clock_settings.h"
+#include "pms7003.h"
+#include "dht22.h"
 
-SoftwareSerial softwareSerial(34, 35); // RX, TX
+SoftwareSerial softwareSerial(34, 33); // RX, TX; GPIO34-39 are input only
 
 const char *SSID = WIFI_SSID;
 const char *PASS = WIFI_PASSWORD;
-const char *server = "mqtt3.thingspeak.com";
+#ifndef MQTT_SERVER
+#define MQTT_SERVER "mqtt3.thingspeak.com"
+#endif
+// Commands arrive on COMMAND_TOPIC and are acknowledged on COMMAND_ACK_TOPIC,
+// by default through fields 7 and 8 of the ThingSpeak channel
+#ifndef COMMAND_TOPIC
+#define COMMAND_TOPIC "channels/" CHANNEL_ID "/subscribe/fields/field7"
+#endif
+#ifndef COMMAND_ACK_TOPIC
+#define COMMAND_ACK_TOPIC "channels/" CHANNEL_ID "/publish"
+#define COMMAND_ACK_FORMAT "&field8=%s %s"
+#endif
+#ifndef COMMAND_ACK_FORMAT
+#define COMMAND_ACK_FORMAT "%s %s"
+#endif
+
+const char *server = MQTT_SERVER;
 const char *channelID = CHANNEL_ID;
 const char *mqttUserName = SECRET_MQTT_USERNAME;
 const char *mqttPass = SECRET_MQTT_PASSWORD;
@@ -26,9 +54,7 @@ const char *clientID = SECRET_MQTT_CLIENT_ID;
 WiFiClient client;
 PubSubClient mqtt(client);
 
-TaskHandle_t Task0, Task1, Task2;
-
-#define CONNECTION_TIMEOUT 20
+TaskHandle_t Task0, Task1, Task2, Task3, Task4, Task5;
 
 #define BUTTON_PIN_LEFT 19
 #define BUTTON_PIN_RIGHT 18
@@ -40,19 +66,108 @@ TaskHandle_t Task0, Task1, Task2;
 #define ALARM_OUT 13
 
 #define DHT_PIN 15
-#define DHT_TYPE DHT22
 
-#define DEBOUNCE_MS 20
-#define INCLUDE_PULLUP true
-#define INVERT true
-#define REPEAT_FIRST 1000
-#define REPEAT_INCR 255
 #define AFK_THRESHOLD 15000
 
 #define EEPROM_SIZE 5
+#define EEPROM_RTC_UTC 3 // holds RTC_UTC_MARK once the RTC keeps UTC
+#define RTC_UTC_MARK 0xA5
+
+#define LCD_ADDRESS 0x27
+#define RTC_ADDRESS 0x68
+#define I2C_STANDARD_HZ 100000 // PCF8574 backpack is only rated for standard mode
+#define I2C_FAST_HZ 400000     // DS3231
+#define I2C_TIMEOUT_MS 20
+
+/*
+   I2C bus scheduler
+
+   Every user of the shared Wire bus goes through i2c_begin()/i2c_end(), which
+   serialize the bus between tasks and switch the bus clock to what the
+   addressed device allows.
+*/
+struct I2CStats
+{
+  uint32_t transactions;
+  uint64_t busy_us;
+  uint32_t latency_max_us;
+  uint32_t wait_max_us;
+  uint32_t nacks;
+  uint32_t timeouts;
+  uint32_t errors;
+  uint32_t bus_clears;
+};
 
-LiquidCrystal_I2C LCD = LiquidCrystal_I2C(0x27, 16, 2);
-DHT dht(DHT_PIN, DHT_TYPE);
+SemaphoreHandle_t i2c_mutex;
+StaticSemaphore_t i2c_mutex_buffer;
+I2CStats i2c_stats;
+uint8_t i2c_depth = 0;
+uint32_t i2c_clock = 0;
+unsigned long i2c_started_us = 0;
+
+void i2c_init();
+void i2c_begin(uint8_t address);
+void i2c_end();
+bool i2c_check(uint8_t status);
+void i2c_bus_clear();
+bool i2c_read(uint8_t address, uint8_t reg, uint8_t *buffer, uint8_t length);
+bool i2c_write(uint8_t address, uint8_t reg, const uint8_t *buffer, uint8_t length);
+time_t rtc_get();
+time_t clock_now();
+void clock_set(time_t utc);
+
+/*
+   HD44780 behind a PCF8574 backpack (P0 RS, P1 RW, P2 E, P3 backlight,
+   P4-P7 D4-D7)
+
+   Every nibble is sent as two expander bytes, one with E high and one with E
+   low, so a whole run of characters including its cursor move goes out as a
+   single I2C write. No busy flag is read: at 100 kHz two expander bytes take
+   180 us, well over the 37 us a character or a short instruction needs, and
+   clear/home are followed by an explicit wait before the next write.
+*/
+#define LCD_RS 0x01
+#define LCD_EN 0x04
+#define LCD_BACKLIGHT 0x08
+#define LCD_BUFFER_SIZE 120 // has to fit Wire's 128 byte buffer
+#define LCD_INSTRUCTION_US 40
+#define LCD_CLEAR_US 1600
+
+class PackedLCD : public Print
+{
+public:
+  PackedLCD(uint8_t address, uint8_t cols, uint8_t rows);
+
+  void init();
+  void clear();
+  void backlight();
+  void noBacklight();
+  void setCursor(uint8_t col, uint8_t row);
+  void createChar(uint8_t location, uint8_t charmap[]);
+  size_t write(uint8_t value) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  void flush();
+
+  // When false every nibble is its own transaction with the delays
+  // LiquidCrystal_I2C uses, kept to benchmark against
+  bool packed = true;
+
+private:
+  void command(uint8_t value, uint32_t exec_us = LCD_INSTRUCTION_US);
+  void send(uint8_t value, uint8_t mode);
+  void send_nibble(uint8_t bits);
+  void transmit(const uint8_t *data, uint8_t length);
+
+  uint8_t address;
+  uint8_t cols;
+  uint8_t rows;
+  uint8_t backlight_bit = LCD_BACKLIGHT;
+  uint8_t buffer[LCD_BUFFER_SIZE];
+  uint8_t length = 0;
+  unsigned long ready_at_us = 0;
+};
+
+PackedLCD LCD(LCD_ADDRESS, 16, 2);
 DS3232RTC RTC;
 
 /*
@@ -168,6 +283,153 @@ byte POWER_THREE[8] = {
     0b00000,
     0b00000};
 
+/*
+   Segments of the big digit clock face
+*/
+byte BIG_LT[8] = {
+    0b00111,
+    0b01111,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11111};
+
+byte BIG_UB[8] = {
+    0b11111,
+    0b11111,
+    0b11111,
+    0b00000,
+    0b00000,
+    0b00000,
+    0b00000,
+    0b00000};
+
+byte BIG_RT[8] = {
+    0b11100,
+    0b11110,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11111};
+
+byte BIG_LL[8] = {
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b01111,
+    0b00111};
+
+byte BIG_LB[8] = {
+    0b00000,
+    0b00000,
+    0b00000,
+    0b00000,
+    0b00000,
+    0b11111,
+    0b11111,
+    0b11111};
+
+byte BIG_LR[8] = {
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11111,
+    0b11110,
+    0b11100};
+
+byte BIG_UMB[8] = {
+    0b11111,
+    0b11111,
+    0b11111,
+    0b00000,
+    0b00000,
+    0b00000,
+    0b11111,
+    0b11111};
+
+/*
+   Glyphs, uploaded to one of the 8 CGRAM slots on demand
+*/
+enum GLYPHS
+{
+  GLYPH_BELL,
+  GLYPH_THERMOMETER,
+  GLYPH_WATER_DROPLET,
+  GLYPH_CHAR_A,
+  GLYPH_CHAR_L,
+  GLYPH_CHAR_C,
+  GLYPH_CHAR_EXCL,
+  GLYPH_MENU_RIGHT_ARROW,
+  GLYPH_MENU_LEFT_ARROW,
+  GLYPH_MU,
+  GLYPH_POWER_THREE,
+  GLYPH_BIG_LT,
+  GLYPH_BIG_UB,
+  GLYPH_BIG_RT,
+  GLYPH_BIG_LL,
+  GLYPH_BIG_LB,
+  GLYPH_BIG_LR,
+  GLYPH_BIG_UMB,
+  GLYPH_COUNT,
+};
+
+byte *const glyph_bitmaps[GLYPH_COUNT] = {
+    BELL,
+    THERMOMETER,
+    WATER_DROPLET,
+    CHAR_A,
+    CHAR_L,
+    CHAR_C,
+    CHAR_EXCL,
+    MENU_RIGHT_ARROW,
+    MENU_LEFT_ARROW,
+    MU,
+    POWER_THREE,
+    BIG_LT,
+    BIG_UB,
+    BIG_RT,
+    BIG_LL,
+    BIG_LB,
+    BIG_LR,
+    BIG_UMB,
+};
+
+#define CGRAM_SLOTS 8
+#define CGRAM_EMPTY 0xff
+
+uint8_t cgram_glyph[CGRAM_SLOTS];     // glyph held by each slot
+uint32_t cgram_last_used[CGRAM_SLOTS]; // LRU stamp
+uint32_t cgram_clock = 0;
+uint32_t cgram_uploads = 0;
+
+/*
+   Big digits, 3 columns by 2 rows each
+*/
+#define BIG_BLANK 0xfe
+#define BIG_FULL 0xff
+
+const uint8_t BIG_DIGITS[10][2][3] = {
+    {{GLYPH_BIG_LT, GLYPH_BIG_UB, GLYPH_BIG_RT}, {GLYPH_BIG_LL, GLYPH_BIG_LB, GLYPH_BIG_LR}},
+    {{GLYPH_BIG_UB, GLYPH_BIG_RT, BIG_BLANK}, {GLYPH_BIG_LB, BIG_FULL, GLYPH_BIG_LB}},
+    {{GLYPH_BIG_UMB, GLYPH_BIG_UMB, GLYPH_BIG_RT}, {GLYPH_BIG_LL, GLYPH_BIG_LB, GLYPH_BIG_LB}},
+    {{GLYPH_BIG_UMB, GLYPH_BIG_UMB, GLYPH_BIG_RT}, {GLYPH_BIG_LB, GLYPH_BIG_LB, GLYPH_BIG_LR}},
+    {{GLYPH_BIG_LL, GLYPH_BIG_LB, BIG_FULL}, {BIG_BLANK, BIG_BLANK, BIG_FULL}},
+    {{BIG_FULL, GLYPH_BIG_UMB, GLYPH_BIG_UMB}, {GLYPH_BIG_LB, GLYPH_BIG_LB, GLYPH_BIG_LR}},
+    {{GLYPH_BIG_LT, GLYPH_BIG_UMB, GLYPH_BIG_UMB}, {GLYPH_BIG_LL, GLYPH_BIG_LB, GLYPH_BIG_LR}},
+    {{GLYPH_BIG_UB, GLYPH_BIG_UB, GLYPH_BIG_RT}, {BIG_BLANK, BIG_BLANK, BIG_FULL}},
+    {{GLYPH_BIG_LT, GLYPH_BIG_UMB, GLYPH_BIG_RT}, {GLYPH_BIG_LL, GLYPH_BIG_LB, GLYPH_BIG_LR}},
+    {{GLYPH_BIG_LT, GLYPH_BIG_UMB, GLYPH_BIG_RT}, {BIG_BLANK, BIG_BLANK, BIG_FULL}},
+};
+
 /*
    States of FSM
 */
@@ -193,6 +455,25 @@ enum STATES
   // Otherwise, it times out after 5 seconds, discards the changes and returns to displaying the time
 };
 
+#define STATE_COUNT (SENSOR + 1)
+
+const char *const state_names[STATE_COUNT] = {
+    "MAIN",
+    "MENU_SET_ALARM",
+    "MENU_SET_TIME",
+    "MENU_SET_DATE",
+    "SET_HOUR",
+    "SET_MINUTE",
+    "SET_DAY",
+    "SET_MONTH",
+    "SET_YEAR",
+    "SET_ALARM_HOUR",
+    "SET_ALARM_MINUTE",
+    "SET_ALARM_ON_OFF",
+    "ALARM_TIME",
+    "SENSOR",
+};
+
 STATES state = MAIN;
 
 enum BUTTONS
@@ -208,52 +489,275 @@ enum BUTTONS
 
 BUTTONS button = IDLE;
 
-struct ClockSettings
+#define ALARM_DISMISSED 0x7ffe // FSM event sent after the alarm stops ringing
+
+// Bit i of every button mask is button_pins[i], which is the BUTTONS value i + 1
+const uint8_t button_pins[BUTTON_COUNT] = {
+    BUTTON_PIN_LEFT,
+    BUTTON_PIN_RIGHT,
+    BUTTON_PIN_UP,
+    BUTTON_PIN_DOWN,
+    BUTTON_PIN_MENU_SELECT,
+    BUTTON_PIN_BACK};
+
+#define BUTTON_BIT(b) (1 << ((b)-1))
+#define BUTTON_REPEAT_MASK (BUTTON_BIT(BUTTON_UP) | BUTTON_BIT(BUTTON_DOWN))
+
+// Every quantity the registered sensor drivers measure, in registration order
+#define SENSOR_MAX_QUANTITIES 8
+#define SENSOR_MISSING INT16_MIN // no reading yet
+
+struct Quantity
 {
-  struct TimeComp
-  {
-    int hour;
-    int minute;
-    int second;
-  };
+  const QuantityInfo *info;
+  volatile int16_t value;
+};
 
-  struct DateComp
-  {
-    int day;
-    int month;
-    int year;
-  };
+Quantity quantities[SENSOR_MAX_QUANTITIES];
+int quantity_count = 0;
+volatile int sensor_aqi = -1; // US EPA AQI from the PM2.5 and PM10 NowCast, -1 until there is enough data
 
-  struct AlarmComp
-  {
-    int hour;
-    int minute;
-    bool active;
-  };
+/*
+   UI text, besides the tables in ui_text.h
+*/
+// Menu screens from left to right
+constexpr struct
+{
+  STATES state;
+  const char *title;
+} MENU_SCREENS[] = {
+    {MENU_SET_TIME, "Set Time"},
+    {MENU_SET_DATE, "Set Date"},
+    {MENU_SET_ALARM, "Set Alarm"},
+};
+constexpr int MENU_SCREEN_COUNT = sizeof(MENU_SCREENS) / sizeof(MENU_SCREENS[0]);
+
+/*
+   Remote commands, parsed by the network task and applied by the FSM task
+*/
+enum COMMANDS
+{
+  COMMAND_SET_ALARM,
+  COMMAND_ALARM_ON,
+  COMMAND_ALARM_OFF,
+  COMMAND_ALARM_TOGGLE,
+  COMMAND_SET_TIME,
+  COMMAND_PUBLISH_INTERVAL,
+};
+
+struct Command
+{
+  COMMANDS type;
+  uint32_t args[2];
+  char id[16];
+  unsigned long received_ms;
+};
+
+struct CommandAck
+{
+  char id[16];
+  bool ok;
+  unsigned long received_ms;
+};
+
+#define COMMAND_QUEUE_LENGTH 4
+#define COMMAND_ID_PREFIX '#' // "#42 alarm on" carries the id 42
+QueueHandle_t command_queue, command_ack_queue;
+StaticQueue_t command_queue_buffer, command_ack_queue_buffer;
+uint8_t command_queue_storage[COMMAND_QUEUE_LENGTH * sizeof(Command)];
+uint8_t command_ack_queue_storage[COMMAND_QUEUE_LENGTH * sizeof(CommandAck)];
+SemaphoreHandle_t mqtt_mutex;
+StaticSemaphore_t mqtt_mutex_buffer;
+uint32_t publish_interval_s = PUBLISH_INTERVAL_S;
+uint32_t publish_min_interval_s = PUBLISH_MIN_INTERVAL_S;
+
+#define SAMPLE_MIN_MS 2000  // the DHT22 cannot be read faster
+#define SAMPLE_MAX_MS 30000
+#define URGENCY_DECAY 10    // percent per sample, so the rate eases back instead of dropping
+#define URGENCY_RAMP_PERCENT 15 // of the alert level, below it closeness adds no urgency
+
+// The AQI alert level; the quantities carry their own in QuantityInfo
+#define AQI_ALERT 151 // Unhealthy
+
+int sensor_urgency = 0; // 0 = calm, 100 = at a threshold or changing fast
+uint32_t sample_interval_ms = SAMPLE_MIN_MS;
+uint32_t publish_effective_s = 150;
+
+#define HISTORY_SIZE 720           // 12 hours
+#define HISTORY_INTERVAL_MS 60000  // one sample a minute
+#define HTTP_PORT 80
+#define HTTP_CHUNK_SIZE 512
+
+struct SensorSample
+{
+  uint32_t time;
+  int16_t values[SENSOR_MAX_QUANTITIES]; // by quantity slot, SENSOR_MISSING for none
+};
+
+SensorSample sensor_history[HISTORY_SIZE];
+uint32_t history_total = 0; // samples ever recorded, the newest is history_total - 1
+portMUX_TYPE history_mux = portMUX_INITIALIZER_UNLOCKED;
+#define LOG_QUEUE_LENGTH 16
+QueueHandle_t log_queue;      // history samples on their way to flash
+SemaphoreHandle_t log_mutex;  // the sensor log files and their index
+StaticQueue_t log_queue_buffer;
+uint8_t log_queue_storage[LOG_QUEUE_LENGTH * sizeof(SensorSample)];
+StaticSemaphore_t log_mutex_buffer;
+
+struct HttpStats
+{
+  uint32_t requests;
+  uint64_t busy_us;
+  uint32_t last_request_us;
+  uint32_t heap_peak; // bytes, worst request
+};
+
+HttpStats http_stats;
+
+/*
+   Metrics registry
+
+   Subsystems bump counters with a relaxed atomic increment, histograms take a
+   short spinlock. Everything is exported in Prometheus text format on
+   /metrics and, when METRICS_TOPIC is set in secrets.h, as a one line
+   summary over MQTT with every keep-alive.
+*/
+enum COUNTERS
+{
+  COUNTER_MQTT_PUBLISH_OK,
+  COUNTER_MQTT_PUBLISH_FAILED,
+  COUNTER_MQTT_RECONNECTS,
+  COUNTER_WIFI_RECONNECTS,
+  COUNTER_PM_HEADER_ERRORS,
+  COUNTER_DHT_FAILURES,
+  COUNTER_ALARM_FIRINGS,
+  COUNTER_COMMANDS_DROPPED,
+  COUNTER_COUNT,
+};
 
-  TimeComp time;
-  DateComp date;
-  AlarmComp alarm;
+enum HISTOGRAMS
+{
+  HISTOGRAM_FSM_TICK_MS,
+  HISTOGRAM_MQTT_PUBLISH_MS,
+  HISTOGRAM_COMMAND_MS,
+  HISTOGRAM_ALARM_LATENCY_US,
+  HISTOGRAM_LOG_QUERY_MS,
+  HISTOGRAM_COUNT,
+};
+
+#define HISTOGRAM_BUCKETS 7
+
+struct MetricInfo
+{
+  const char *name;
+  const char *help;
+};
+
+struct Histogram
+{
+  uint32_t bounds[HISTOGRAM_BUCKETS];
+  uint32_t buckets[HISTOGRAM_BUCKETS + 1]; // last one is +Inf
+  uint32_t count;
+  uint64_t sum;
+};
+
+const MetricInfo counter_info[COUNTER_COUNT] = {
+    {"alarm_clock_mqtt_publish_ok_total", "MQTT publishes accepted by the client"},
+    {"alarm_clock_mqtt_publish_failed_total", "MQTT publishes that failed"},
+    {"alarm_clock_mqtt_reconnects_total", "MQTT connect attempts"},
+    {"alarm_clock_wifi_reconnects_total", "WiFi association attempts"},
+    {"alarm_clock_pm_header_errors_total", "PMS7003 frames without a valid header"},
+    {"alarm_clock_dht_failures_total", "DHT22 reads that returned no value"},
+    {"alarm_clock_alarm_firings_total", "Times the alarm has gone off"},
+    {"alarm_clock_commands_dropped_total", "Command messages that did not parse and got no acknowledgement"},
+};
+
+const MetricInfo histogram_info[HISTOGRAM_COUNT] = {
+    {"alarm_clock_fsm_tick_ms", "Duration of one FSM tick"},
+    {"alarm_clock_mqtt_publish_ms", "Duration of one MQTT publish"},
+    {"alarm_clock_command_ms", "Time from receiving a command to publishing its acknowledgement"},
+    {"alarm_clock_alarm_latency_us", "Time from the RTC alarm interrupt to the buzzer turning on"},
+    {"alarm_clock_log_query_ms", "Flash time spent reading one sensor log range"},
+};
+
+std::atomic<uint32_t> counters[COUNTER_COUNT];
+std::atomic<uint32_t> state_entries[STATE_COUNT];
+Histogram histograms[HISTOGRAM_COUNT] = {
+    {{1, 5, 10, 50, 100, 500, 1000}},
+    {{5, 10, 50, 100, 500, 1000, 5000}},
+    {{5, 10, 50, 100, 200, 500, 1000}},
+    {{10, 20, 50, 100, 200, 500, 1000}},
+    {{1, 5, 10, 50, 100, 500, 1000}},
+};
+portMUX_TYPE metrics_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/*
+   Post-mortem log
+
+   A ring of recent events in RTC slow memory, which keeps its contents
+   through panics, watchdog resets and ESP.restart() but not a power cycle.
+   It is printed at boot, so the events leading up to a crash can be read
+   after the fact.
+*/
+#define POSTMORTEM_MAGIC 0x504d4c31
+#define POSTMORTEM_EVENTS 64
+#define POSTMORTEM_STABLE_MS 600000 // a boot that lasts this long ends a crash streak
+#define POSTMORTEM_CRASH_LOOP 3
+
+enum EVENTS : uint8_t
+{
+  EVENT_BOOT,           // arg: esp_reset_reason_t
+  EVENT_STATE,          // arg: STATES
+  EVENT_BUTTON,         // arg: BUTTONS
+  EVENT_WIFI_LOST,
+  EVENT_MQTT_LOST,      // arg: PubSubClient state
+  EVENT_MQTT_CONNECTED,
+  EVENT_PUBLISH_FAILED,
+  EVENT_I2C_ERROR,      // arg: Wire status
+  EVENT_SENSOR_ERROR,   // arg: COUNTERS
+  EVENT_TASK_STALL,     // arg: supervised task index
+  EVENT_TASK_RESTART,   // arg: supervised task index
+  EVENT_REBOOT,         // arg: supervised task index, 0xff for an OTA update
+  EVENT_COUNT,
+};
+
+const char *const event_names[EVENT_COUNT] = {
+    "boot", "state", "button", "wifi_lost", "mqtt_lost", "mqtt_connected", "publish_failed",
+    "i2c_error", "sensor_error", "task_stall", "task_restart", "reboot"};
+
+struct PostmortemEvent
+{
+  uint32_t ms; // of the last repeat
+  uint16_t boot;
+  uint8_t type;
+  uint8_t arg;
+  uint16_t repeats; // back-to-back duplicates are folded into one entry
 };
 
-struct SensorValues
+struct PostmortemLog
 {
-  int humidity = 0;
-  int temperature = 0;
-  int pm1 = 0;
-  int pm2_5 = 0;
-  int pm10 = 0;
+  uint32_t magic;
+  uint32_t boot_count;   // since power on
+  uint32_t crash_count;  // panics, watchdog and brownout resets
+  uint32_t crash_streak; // crashes since the last stable boot
+  uint32_t head;         // events ever recorded, the newest is head - 1
+  uint8_t last_state;
+  uint8_t last_button;
+  PostmortemEvent events[POSTMORTEM_EVENTS];
 };
 
-volatile SensorValues sensor_values;
+RTC_NOINIT_ATTR PostmortemLog postmortem;
+uint32_t postmortem_boot_head;      // first event of this boot
+uint8_t postmortem_previous[2];     // last state and button of the previous boot
+portMUX_TYPE postmortem_mux = portMUX_INITIALIZER_UNLOCKED;
 SemaphoreHandle_t sendReadySemaphore, sendKeepAliveSemaphore;
-hw_timer_t *timer = NULL;
+StaticSemaphore_t sendReadySemaphore_buffer, sendKeepAliveSemaphore_buffer;
 hw_timer_t *keepAlive = NULL;
 
 ClockSettings clock_settings;
 
 int8_t dow;
-String day_of_week;
+int32_t alarm_offset_s = INT32_MIN; // UTC offset the RTC alarm was programmed with
 
 uint32_t blink_interval = 300;
 uint32_t blink_previous_millis = 0;
@@ -261,8 +765,17 @@ unsigned long last_activity_time = 0;
 bool is_AFK = false;
 bool blink_state = false;
 bool long_press_button = false;
-unsigned long rpt = REPEAT_FIRST;
-volatile bool alarm_isr_was_called = false;
+bool button_repeated = false; // button came from auto-repeat, not a fresh press
+bool big_clock_face = false;
+
+hw_timer_t *buttonScanTimer = NULL;
+portMUX_TYPE button_mux = portMUX_INITIALIZER_UNLOCKED;
+ButtonScanner button_scanner; // only the scan ISR writes it
+volatile ButtonEvents button_events;
+volatile uint32_t button_scan_cycles = 0;
+volatile uint32_t button_scan_cycles_max = 0;
+volatile bool ota_pending_verify = false;
+unsigned long boot_first_frame_us = 0;
 
 /*
    Transition callback functions on ENTER
@@ -316,41 +829,63 @@ void on_date_set();
 void display_date(int row, int col);
 void display_date_of_week(int row, int col);
 void get_alarm();
+void display_alarm_indicator(int col, int row);
 void set_alarm();
+void program_alarm();
 void on_alarm_set();
 
-void get_pm();
-void display_menu(String menu);
-void get_temperature_humidity();
+void update_air_quality();
+void air_quality_reading(const char *name, int value);
+int quantity_value(const char *name);
+void display_aqi(int row);
+void sample_sensors(bool watching);
+bool sensor_alert();
+int mqtt_payload(char *payload, size_t size);
+void display_menu(STATES menu);
+void cgram_reset();
+uint8_t glyph_slot(GLYPHS glyph);
+void write_glyph(GLYPHS glyph, int col, int row);
+void display_big_digit(int digit, int col);
+void display_big_time();
 void display_temperature(int row, int col);
 void display_humidity(int row, int col);
 void display_pm_2_5(int col);
 void check_button();
+void begin_buttons();
+ButtonEvents read_button_events();
 void check_AFK();
 void not_AFK();
 void transition(BUTTONS trigger);
-byte dec2bcd(byte val);
-byte bcd2dec(byte val);
 void display_position(int digits);
-void increase(int &number, int max, int min);
-void decrease(int &number, int max, int min);
 void update_clock_settings();
 void reset_blink();
 void blink_millis();
 void blink(int value, int col, int row);
-void blink(String value, int col, int row);
+void blink(const char *value, int col, int row);
 void alarm_isr();
-void beep();
-
-/*
-   Initialize push buttons
-*/
-Button buttonLeft(BUTTON_PIN_LEFT, DEBOUNCE_MS, INCLUDE_PULLUP, INVERT);
-Button buttonRight(BUTTON_PIN_RIGHT, DEBOUNCE_MS, INCLUDE_PULLUP, INVERT);
-Button buttonUp(BUTTON_PIN_UP, DEBOUNCE_MS, INCLUDE_PULLUP, INVERT);
-Button buttonDown(BUTTON_PIN_DOWN, DEBOUNCE_MS, INCLUDE_PULLUP, INVERT);
-Button buttonOK(BUTTON_PIN_MENU_SELECT, DEBOUNCE_MS, INCLUDE_PULLUP, INVERT);
-Button buttonBack(BUTTON_PIN_BACK, DEBOUNCE_MS, INCLUDE_PULLUP, INVERT);
+void record_first_frame();
+void count_metric(COUNTERS counter);
+void observe_metric(HISTOGRAMS histogram, uint32_t value);
+void enter_state(STATES new_state);
+void postmortem_record(EVENTS type, uint8_t arg);
+bool publish_mqtt(const char *topic, const char *payload);
+void record_sensor_history();
+void process_commands();
+void heartbeat();
+void task_safe_point();
+bool task_stop_pending();
+void report_tick_jitter();
+void report_cpu_usage();
+void http_task(void *parameter);
+void sensor_log_task(void *parameter);
+void print_log_stats();
+void send_mqtt_task(void *parameter);
+void ota_begin_verify();
+void ota_confirm_boot();
+void ota_check_verify_deadline();
+#ifdef SERIAL_TELEMETRY
+void telemetry_publish(bool ok, uint32_t duration_ms);
+#endif
 
 /*
    Initialize states of FSM
@@ -379,6 +914,15 @@ void fsm_add_transitions()
   fsm.add_transition(&state_main, &state_display_alarm_time, BUTTON_RIGHT, NULL);
   fsm.add_transition(&state_main, &state_display_sensor_values, BUTTON_LEFT, NULL);
 
+  // Any state, once the alarm has rung
+  State *all_states[] = {
+      &state_main, &state_menu_set_time, &state_menu_set_date, &state_menu_set_alarm,
+      &state_set_hour, &state_set_minute, &state_set_day, &state_set_month, &state_set_year,
+      &state_set_alarm_hour, &state_set_alarm_minute, &state_set_alarm_on_off,
+      &state_display_alarm_time, &state_display_sensor_values};
+  for (State *from : all_states)
+    fsm.add_transition(from, &state_main, ALARM_DISMISSED, NULL);
+
   // ALARM_TIME
   fsm.add_timed_transition(&state_display_alarm_time, &state_main, 3000, NULL);
 
@@ -444,168 +988,3905 @@ void fsm_add_transitions()
   fsm.add_transition(&state_set_alarm_on_off, &state_main, BUTTON_BACK, &on_cancel);
 }
 
-void spinner()
+void count_metric(COUNTERS counter)
+{
+  counters[counter].fetch_add(1, std::memory_order_relaxed);
+}
+
+void observe_metric(HISTOGRAMS histogram, uint32_t value)
 {
-  static int8_t counter = 0;
-  const char *glyphs = "\xa1\xa5\xdb";
-  LCD.setCursor(15, 1);
-  LCD.print(glyphs[counter++]);
-  if (counter == strlen(glyphs))
+  Histogram &h = histograms[histogram];
+  int bucket = 0;
+  while (bucket < HISTOGRAM_BUCKETS && value > h.bounds[bucket])
+    bucket++;
+
+  portENTER_CRITICAL(&metrics_mux);
+  h.buckets[bucket]++;
+  h.count++;
+  h.sum += value;
+  portEXIT_CRITICAL(&metrics_mux);
+}
+
+void enter_state(STATES new_state)
+{
+  state = new_state;
+  state_entries[new_state].fetch_add(1, std::memory_order_relaxed);
+  postmortem.last_state = new_state;
+  postmortem_record(EVENT_STATE, new_state);
+}
+
+bool publish_mqtt(const char *topic, const char *payload)
+{
+  unsigned long start = millis();
+  xSemaphoreTakeRecursive(mqtt_mutex, portMAX_DELAY);
+  bool ok = mqtt.publish(topic, payload);
+  xSemaphoreGiveRecursive(mqtt_mutex);
+  observe_metric(HISTOGRAM_MQTT_PUBLISH_MS, millis() - start);
+#ifdef SERIAL_TELEMETRY
+  telemetry_publish(ok, millis() - start);
+#endif
+  count_metric(ok ? COUNTER_MQTT_PUBLISH_OK : COUNTER_MQTT_PUBLISH_FAILED);
+  if (!ok)
+    postmortem_record(EVENT_PUBLISH_FAILED, 0);
+  return ok;
+}
+
+// CRC-16/CCITT-FALSE, for the telemetry frames and the sensor log records
+uint16_t crc16_ccitt(const uint8_t *data, size_t length, uint16_t crc = 0xffff)
+{
+  while (length--)
   {
-    counter = 0;
+    crc ^= *data++ << 8;
+    for (int i = 0; i < 8; i++)
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
   }
+  return crc;
 }
 
-void connect_wifi()
+/*
+   Serial telemetry
+
+   With -D SERIAL_TELEMETRY the clock streams binary frames over the USB
+   serial port at 921600 baud, mixed with the usual text log:
+
+     0xA5 0x5A | type | length | micros() u32 | payload | CRC-16/CCITT
+
+   The CRC covers type to payload, multi-byte values are little endian.
+   Frames are queued in a ring and never block the caller; telemetry_task
+   writes whole frames only when the UART buffer can take them, so text from
+   other tasks cannot split a frame. tools/telemetry_decode.py turns a capture
+   into CSV files.
+
+   The UART driver in this core has no TX DMA; the ESP32's UHCI engine that
+   could feed the UART has no driver in IDF 4.4. Its TX ring buffer, drained
+   by the FIFO-empty interrupt, is the closest there is, and Serial uses it
+   (setTxBufferSize in setup). A Serial.write still takes a mutex and blocks
+   once that buffer is full, so producers go through the lock-free ring
+   above instead and only telemetry_task ever waits on the UART.
+*/
+#ifdef SERIAL_TELEMETRY
+#define TELEMETRY_BUFFER 2048
+#define TELEMETRY_MAX_PAYLOAD 24
+#define TELEMETRY_OVERHEAD 10 // sync, type, length, timestamp, CRC
+
+enum TELEMETRY_TYPES : uint8_t
 {
-  LCD.init();
-  LCD.backlight();
-  LCD.setCursor(0, 0);
-  LCD.print("CONNECTING TO ");
-  LCD.setCursor(0, 1);
-  LCD.print("WiFi ");
+  TELEMETRY_SENSORS, // u8 driver, int16 aqi, then one int16 per quantity in slot order
+  TELEMETRY_TICK,    // u32 period_us, u32 run_us, u8 state
+  TELEMETRY_EVENT,   // u8 EVENTS, u8 arg
+  TELEMETRY_PUBLISH, // u8 ok, u16 duration_ms
+};
 
-  int timeout_counter = 0;
+struct TelemetryStats
+{
+  uint32_t frames;
+  uint32_t dropped;
+  uint32_t bytes;
+};
 
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(SSID, PASS);
-  while (WiFi.status() != WL_CONNECTED)
+uint8_t telemetry_ring[TELEMETRY_BUFFER];
+uint32_t telemetry_head = 0, telemetry_tail = 0; // free running, head is written by producers
+TelemetryStats telemetry_stats;
+portMUX_TYPE telemetry_mux = portMUX_INITIALIZER_UNLOCKED;
+
+void telemetry_send(TELEMETRY_TYPES type, const void *payload, uint8_t length)
+{
+  uint8_t frame[TELEMETRY_MAX_PAYLOAD + TELEMETRY_OVERHEAD];
+  uint32_t timestamp = micros();
+
+  frame[0] = 0xa5;
+  frame[1] = 0x5a;
+  frame[2] = type;
+  frame[3] = length;
+  memcpy(frame + 4, &timestamp, 4);
+  memcpy(frame + 8, payload, length);
+  uint16_t crc = crc16_ccitt(frame + 2, length + 6);
+  memcpy(frame + 8 + length, &crc, 2);
+  size_t size = length + TELEMETRY_OVERHEAD;
+
+  portENTER_CRITICAL(&telemetry_mux);
+  if (TELEMETRY_BUFFER - (telemetry_head - telemetry_tail) < size)
+  {
+    telemetry_stats.dropped++;
+  }
+  else
   {
-    delay(250);
-    spinner();
+    for (size_t i = 0; i < size; i++)
+      telemetry_ring[(telemetry_head + i) % TELEMETRY_BUFFER] = frame[i];
+    telemetry_head += size;
+    telemetry_stats.frames++;
+  }
+  portEXIT_CRITICAL(&telemetry_mux);
+}
+
+// Sent for every record a sensor driver returns
+void telemetry_sensors(uint8_t driver)
+{
+  uint8_t payload[1 + (1 + SENSOR_MAX_QUANTITIES) * 2];
+  int16_t values[1 + SENSOR_MAX_QUANTITIES];
+  values[0] = sensor_aqi;
+  for (int i = 0; i < quantity_count; i++)
+    values[1 + i] = quantities[i].value;
+  payload[0] = driver;
+  memcpy(payload + 1, values, (1 + quantity_count) * sizeof(values[0]));
+  telemetry_send(TELEMETRY_SENSORS, payload, 1 + (1 + quantity_count) * sizeof(values[0]));
+}
+
+void telemetry_publish(bool ok, uint32_t duration_ms)
+{
+  uint16_t ms = min(duration_ms, (uint32_t)UINT16_MAX);
+  uint8_t payload[3] = {ok, (uint8_t)ms, (uint8_t)(ms >> 8)};
+  telemetry_send(TELEMETRY_PUBLISH, payload, sizeof(payload));
+}
+
+void telemetry_tick(uint32_t period_us, uint32_t run_us)
+{
+  uint8_t payload[9];
+  memcpy(payload, &period_us, 4);
+  memcpy(payload + 4, &run_us, 4);
+  payload[8] = state;
+  telemetry_send(TELEMETRY_TICK, payload, sizeof(payload));
+}
 
-    timeout_counter++;
-    if (timeout_counter >= CONNECTION_TIMEOUT * 5)
+StackType_t telemetry_stack[2048];
+StaticTask_t telemetry_tcb;
+
+void telemetry_task(void *parameter)
+{
+  uint8_t frame[TELEMETRY_MAX_PAYLOAD + TELEMETRY_OVERHEAD];
+  for (;;)
+  {
+    // Only this task moves the tail, so the frame can be copied out unlocked
+    while (telemetry_head != telemetry_tail)
     {
-      ESP.restart();
+      size_t size = telemetry_ring[(telemetry_tail + 3) % TELEMETRY_BUFFER] + TELEMETRY_OVERHEAD;
+      if (Serial.availableForWrite() < (int)size)
+        break;
+
+      for (size_t i = 0; i < size; i++)
+        frame[i] = telemetry_ring[(telemetry_tail + i) % TELEMETRY_BUFFER];
+      Serial.write(frame, size);
+
+      portENTER_CRITICAL(&telemetry_mux);
+      telemetry_tail += size;
+      telemetry_stats.bytes += size;
+      portEXIT_CRITICAL(&telemetry_mux);
     }
+    vTaskDelay(5 / portTICK_PERIOD_MS);
+  }
+}
+#endif
+
+/*
+   Post-mortem log
+*/
+const char *reset_reason_name(int reason)
+{
+  switch (reason)
+  {
+  case ESP_RST_POWERON:
+    return "power on";
+  case ESP_RST_EXT:
+    return "external";
+  case ESP_RST_SW:
+    return "restart";
+  case ESP_RST_PANIC:
+    return "panic";
+  case ESP_RST_INT_WDT:
+    return "interrupt watchdog";
+  case ESP_RST_TASK_WDT:
+    return "task watchdog";
+  case ESP_RST_WDT:
+    return "watchdog";
+  case ESP_RST_DEEPSLEEP:
+    return "deep sleep";
+  case ESP_RST_BROWNOUT:
+    return "brownout";
+  default:
+    return "unknown";
+  }
+}
+
+void postmortem_begin()
+{
+  esp_reset_reason_t reason = esp_reset_reason();
+
+  // RTC memory holds noise after a power cycle
+  if (reason == ESP_RST_POWERON || postmortem.magic != POSTMORTEM_MAGIC)
+  {
+    memset(&postmortem, 0, sizeof(postmortem));
+    postmortem.magic = POSTMORTEM_MAGIC;
+    postmortem.last_state = MAIN;
+    postmortem.last_button = IDLE;
+  }
+
+  postmortem.boot_count++;
+  if (reason == ESP_RST_PANIC || reason == ESP_RST_INT_WDT || reason == ESP_RST_TASK_WDT ||
+      reason == ESP_RST_WDT || reason == ESP_RST_BROWNOUT)
+  {
+    postmortem.crash_count++;
+    postmortem.crash_streak++;
+  }
+
+  postmortem_previous[0] = postmortem.last_state;
+  postmortem_previous[1] = postmortem.last_button;
+  postmortem_boot_head = postmortem.head;
+  postmortem_record(EVENT_BOOT, reason);
+}
+
+void postmortem_record(EVENTS type, uint8_t arg)
+{
+  uint16_t boot = postmortem.boot_count;
+  uint32_t now_ms = millis();
+
+  portENTER_CRITICAL(&postmortem_mux);
+  PostmortemEvent *last = postmortem.head > postmortem_boot_head ? &postmortem.events[(postmortem.head - 1) % POSTMORTEM_EVENTS] : NULL;
+  if (last && last->type == type && last->arg == arg && last->repeats < UINT16_MAX)
+  {
+    last->repeats++;
+    last->ms = now_ms;
+  }
+  else
+  {
+    postmortem.events[postmortem.head % POSTMORTEM_EVENTS] = {now_ms, boot, type, arg, 0};
+    postmortem.head++;
+  }
+  portEXIT_CRITICAL(&postmortem_mux);
+
+#ifdef SERIAL_TELEMETRY
+  uint8_t payload[2] = {type, arg};
+  telemetry_send(TELEMETRY_EVENT, payload, sizeof(payload));
+#endif
+}
+
+// Called once the clock has run long enough to not count as a crash loop
+void postmortem_mark_stable()
+{
+  if (millis() >= POSTMORTEM_STABLE_MS)
+    postmortem.crash_streak = 0;
+}
+
+void postmortem_dump()
+{
+  uint32_t head = postmortem.head;
+  uint32_t first = head > POSTMORTEM_EVENTS ? head - POSTMORTEM_EVENTS : 0;
+
+  Serial.printf("Post-mortem: boot %u, reset: %s, %u crashes, %u in a row\n",
+                postmortem.boot_count, reset_reason_name(esp_reset_reason()),
+                postmortem.crash_count, postmortem.crash_streak);
+  if (postmortem.boot_count > 1)
+    Serial.printf("Previous boot ended in state %s, last button %u\n",
+                  state_names[postmortem_previous[0] % STATE_COUNT], postmortem_previous[1]);
+  if (postmortem.crash_streak >= POSTMORTEM_CRASH_LOOP)
+    Serial.println("Post-mortem: crash loop");
+
+  for (uint32_t i = first; i < head; i++)
+  {
+    PostmortemEvent e = postmortem.events[i % POSTMORTEM_EVENTS];
+    Serial.printf("  boot %u %8u ms %-14s %u", e.boot, e.ms, e.type < EVENT_COUNT ? event_names[e.type] : "?", e.arg);
+    if (e.repeats)
+      Serial.printf(" (x%u)", e.repeats + 1);
+    Serial.println();
   }
+}
 
-  Serial.println("");
-  Serial.println("WiFi connected");
-  Serial.print("IP address: ");
-  Serial.println(WiFi.localIP());
+#ifdef POSTMORTEM_TOPIC
+bool publish_postmortem()
+{
+  char payload[160];
+  uint32_t previous_head = postmortem_boot_head;
+  PostmortemEvent last = previous_head ? postmortem.events[(previous_head - 1) % POSTMORTEM_EVENTS] : PostmortemEvent{0, 0, EVENT_BOOT, 0, 0};
+
+  snprintf(payload, sizeof(payload),
+           "boot=%u reset=%s crashes=%u streak=%u last_state=%s last_button=%u last_event=%s:%u",
+           postmortem.boot_count, reset_reason_name(esp_reset_reason()), postmortem.crash_count,
+           postmortem.crash_streak, state_names[postmortem_previous[0] % STATE_COUNT], postmortem_previous[1],
+           last.type < EVENT_COUNT ? event_names[last.type] : "?", last.arg);
+  return publish_mqtt(POSTMORTEM_TOPIC, payload);
+}
+#endif
+
+// Starts the WiFi association in the background. The clock does not wait for
+// it, WIFI_MQTT_connection() in the network tasks picks the link up once the
+// router answers.
+void connect_wifi()
+{
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(true);
+  WiFi.begin(SSID, PASS);
+}
+
+void record_first_frame()
+{
+  if (boot_first_frame_us != 0)
+    return;
+
+  boot_first_frame_us = micros();
+  ota_confirm_boot();
+  Serial.print("Boot to first frame: ");
+  Serial.print(boot_first_frame_us / 1000);
+  Serial.println(" ms");
+}
+
+/*
+   CGRAM glyph cache
+
+   The 8 CGRAM slots hold the most recently used glyphs. A glyph is uploaded
+   only when a screen asks for one that is not loaded, replacing the least
+   recently used one. Every screen redraws its glyphs each tick, so as long as
+   a screen needs at most 8 of them, nothing it shows gets evicted.
+*/
+void cgram_reset()
+{
+  for (int i = 0; i < CGRAM_SLOTS; i++)
+  {
+    cgram_glyph[i] = CGRAM_EMPTY;
+    cgram_last_used[i] = 0;
+  }
+}
+
+// Uploading moves the LCD address counter into CGRAM, so callers have to
+// position the cursor after this returns.
+uint8_t glyph_slot(GLYPHS glyph)
+{
+  uint8_t lru = 0;
+  cgram_clock++;
+
+  for (uint8_t i = 0; i < CGRAM_SLOTS; i++)
+  {
+    if (cgram_glyph[i] == glyph)
+    {
+      cgram_last_used[i] = cgram_clock;
+      return i;
+    }
+    if (cgram_last_used[i] < cgram_last_used[lru])
+      lru = i;
+  }
+
+  LCD.createChar(lru, glyph_bitmaps[glyph]);
+  cgram_glyph[lru] = glyph;
+  cgram_last_used[lru] = cgram_clock;
+  cgram_uploads++;
+  return lru;
+}
+
+void write_glyph(GLYPHS glyph, int col, int row)
+{
+  uint8_t slot = glyph_slot(glyph);
+  LCD.setCursor(col, row);
+  LCD.write(slot);
+}
+
+void i2c_init()
+{
+  i2c_mutex = xSemaphoreCreateRecursiveMutexStatic(&i2c_mutex_buffer);
+  Wire.begin(SDA, SCL, I2C_STANDARD_HZ);
+  Wire.setTimeOut(I2C_TIMEOUT_MS);
+  i2c_clock = I2C_STANDARD_HZ;
+}
+
+void i2c_begin(uint8_t address)
+{
+  unsigned long start = micros();
+  xSemaphoreTakeRecursive(i2c_mutex, portMAX_DELAY);
+  if (i2c_depth++ == 0)
+  {
+    i2c_started_us = micros();
+    if (i2c_started_us - start > i2c_stats.wait_max_us)
+      i2c_stats.wait_max_us = i2c_started_us - start;
+  }
+
+  uint32_t clock = address == RTC_ADDRESS ? I2C_FAST_HZ : I2C_STANDARD_HZ;
+  if (clock != i2c_clock)
+  {
+    Wire.setClock(clock);
+    i2c_clock = clock;
+  }
+}
+
+void i2c_end()
+{
+  if (--i2c_depth == 0)
+  {
+    uint32_t elapsed = micros() - i2c_started_us;
+    i2c_stats.transactions++;
+    i2c_stats.busy_us += elapsed;
+    if (elapsed > i2c_stats.latency_max_us)
+      i2c_stats.latency_max_us = elapsed;
+  }
+  xSemaphoreGiveRecursive(i2c_mutex);
+}
+
+// Counts the result of endTransmission() and recovers the bus when a device
+// is holding it. Returns true on success.
+bool i2c_check(uint8_t status)
+{
+  switch (status)
+  {
+  case 0:
+    return true;
+  case 2: // address NACK
+  case 3: // data NACK
+    i2c_stats.nacks++;
+    postmortem_record(EVENT_I2C_ERROR, status);
+    return false;
+  case 5: // timeout
+    i2c_stats.timeouts++;
+    postmortem_record(EVENT_I2C_ERROR, status);
+    i2c_bus_clear();
+    return false;
+  default:
+    i2c_stats.errors++;
+    postmortem_record(EVENT_I2C_ERROR, status);
+    i2c_bus_clear();
+    return false;
+  }
+}
+
+// Clocks SCL until a slave that is stuck mid-byte releases SDA, then issues a
+// STOP and restarts the Wire driver. Must be called inside a transaction.
+void i2c_bus_clear()
+{
+  Wire.end();
+
+  pinMode(SDA, INPUT_PULLUP);
+  pinMode(SCL, OUTPUT_OPEN_DRAIN);
+  digitalWrite(SCL, HIGH);
+  for (int i = 0; i < 9 && digitalRead(SDA) == LOW; i++)
+  {
+    digitalWrite(SCL, LOW);
+    delayMicroseconds(5);
+    digitalWrite(SCL, HIGH);
+    delayMicroseconds(5);
+  }
+
+  pinMode(SDA, OUTPUT_OPEN_DRAIN);
+  digitalWrite(SDA, LOW);
+  delayMicroseconds(5);
+  digitalWrite(SDA, HIGH);
+  delayMicroseconds(5);
+
+  Wire.begin(SDA, SCL, i2c_clock);
+  Wire.setTimeOut(I2C_TIMEOUT_MS);
+  i2c_stats.bus_clears++;
+}
+
+bool i2c_read(uint8_t address, uint8_t reg, uint8_t *buffer, uint8_t length)
+{
+  i2c_begin(address);
+  Wire.beginTransmission(address);
+  Wire.write(reg);
+  bool ok = i2c_check(Wire.endTransmission());
+  if (ok && Wire.requestFrom(address, length) != length)
+  {
+    i2c_stats.errors++;
+    i2c_bus_clear();
+    ok = false;
+  }
+  for (uint8_t i = 0; ok && i < length; i++)
+    buffer[i] = Wire.read();
+  i2c_end();
+  return ok;
+}
+
+bool i2c_write(uint8_t address, uint8_t reg, const uint8_t *buffer, uint8_t length)
+{
+  i2c_begin(address);
+  Wire.beginTransmission(address);
+  Wire.write(reg);
+  Wire.write(buffer, length);
+  bool ok = i2c_check(Wire.endTransmission());
+  i2c_end();
+  return ok;
+}
+
+// Sync provider for TimeLib, which otherwise reads the RTC behind our back
+time_t rtc_get()
+{
+  i2c_begin(RTC_ADDRESS);
+  time_t t = RTC.get();
+  i2c_end();
+  return t;
+}
+
+/*
+   TimeLib keeps its clock in plain globals that now() updates while it
+   reads them, so two tasks calling it at once, one on each core, can step
+   the same second twice and leave the clock weeks ahead. Every task reads
+   and sets the time through these instead.
+*/
+SemaphoreHandle_t time_mutex;
+StaticSemaphore_t time_mutex_buffer;
+
+time_t clock_now()
+{
+  xSemaphoreTake(time_mutex, portMAX_DELAY);
+  time_t t = now();
+  xSemaphoreGive(time_mutex);
+  return t;
+}
+
+void clock_set(time_t utc)
+{
+  xSemaphoreTake(time_mutex, portMAX_DELAY);
+  setTime(utc);
+  xSemaphoreGive(time_mutex);
+}
+
+/*
+   Time zone
+
+   The DS3231 keeps UTC and everything shown or set on the clock is local.
+   The UTC offset changes of the configured zone are computed at compile time
+   from its DST rule. The offset in effect is cached with the window it is
+   valid for, so a lookup is two compares until the next transition.
+   Select the zone with -D TIME_ZONE=TZ_CENTRAL_EUROPE or in secrets.h.
+*/
+struct TzRule
+{
+  int16_t std_offset_min;
+  int16_t dst_offset_min; // equal to std_offset_min for zones without DST
+  // Sunday n (5 = last) of the month, at a local wall clock hour
+  uint8_t start_month, start_week, start_hour; // standard time
+  uint8_t end_month, end_week, end_hour;       // daylight time
+};
+
+#define TZ_UTC {0, 0, 0, 0, 0, 0, 0, 0}
+#define TZ_BANGKOK {420, 420, 0, 0, 0, 0, 0, 0}
+#define TZ_CENTRAL_EUROPE {60, 120, 3, 5, 2, 10, 5, 3}
+#define TZ_US_EASTERN {-300, -240, 3, 2, 2, 11, 1, 2}
+#define TZ_US_PACIFIC {-480, -420, 3, 2, 2, 11, 1, 2}
+#define TZ_SYDNEY {600, 660, 10, 1, 2, 4, 1, 3}
+
+#ifndef TIME_ZONE
+#define TIME_ZONE TZ_BANGKOK
+#endif
+
+#define TZ_FIRST_YEAR CLOCK_FIRST_YEAR
+#define TZ_LAST_YEAR CLOCK_LAST_YEAR
+
+struct TzTransition
+{
+  uint32_t utc;
+  int16_t offset_min; // in effect from utc on
+};
+
+struct TzTable
+{
+  TzTransition at[2 * (TZ_LAST_YEAR - TZ_FIRST_YEAR + 1)];
+  int count;
+};
+
+constexpr int32_t days_from_civil(int y, int m, int d)
+{
+  y -= m <= 2;
+  int era = y / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+constexpr int days_in_month(int y, int m)
+{
+  return m == 2 ? ((y % 4 == 0 && y % 100 != 0) || y % 400 == 0 ? 29 : 28) : (m == 4 || m == 6 || m == 9 || m == 11 ? 30 : 31);
+}
+
+// Days since 1970 of Sunday number week (5 = last) in the month
+constexpr int32_t nth_sunday(int y, int m, int week)
+{
+  int32_t first = days_from_civil(y, m, 1);
+  int32_t sunday = first + (7 - (first + 4) % 7) % 7; // 1970-01-01 was a Thursday
+  sunday += 7 * (week - 1);
+  while (sunday >= first + days_in_month(y, m))
+    sunday -= 7;
+  return sunday;
+}
+
+constexpr TzTable make_tz_table(TzRule rule)
+{
+  TzTable table = {};
+  if (rule.std_offset_min == rule.dst_offset_min)
+    return table;
+
+  for (int y = TZ_FIRST_YEAR; y <= TZ_LAST_YEAR; y++)
+  {
+    TzTransition start = {(uint32_t)((int64_t)nth_sunday(y, rule.start_month, rule.start_week) * 86400 + rule.start_hour * 3600 - rule.std_offset_min * 60), rule.dst_offset_min};
+    TzTransition end = {(uint32_t)((int64_t)nth_sunday(y, rule.end_month, rule.end_week) * 86400 + rule.end_hour * 3600 - rule.dst_offset_min * 60), rule.std_offset_min};
+    // Southern zones end DST before they start it again
+    table.at[table.count++] = start.utc < end.utc ? start : end;
+    table.at[table.count++] = start.utc < end.utc ? end : start;
+  }
+  return table;
+}
+
+constexpr TzRule tz_rule = TIME_ZONE;
+constexpr TzTable tz_table = make_tz_table(tz_rule);
+
+struct TzWindow
+{
+  uint32_t from, until; // UTC, until is exclusive
+  int32_t offset_s;
+};
+
+TzWindow tz_window = {1, 0, 0}; // empty, so the first lookup fills it
+
+int32_t tz_offset(time_t utc)
+{
+  uint32_t t = utc;
+  if (t >= tz_window.from && t < tz_window.until)
+    return tz_window.offset_s;
+
+  if (tz_table.count == 0)
+  {
+    tz_window = {0, UINT32_MAX, tz_rule.std_offset_min * 60};
+    return tz_window.offset_s;
+  }
+
+  // Last transition at or before t
+  int lo = 0, hi = tz_table.count;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (tz_table.at[mid].utc <= t)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == 0)
+  {
+    int16_t before = tz_table.at[0].offset_min == tz_rule.dst_offset_min ? tz_rule.std_offset_min : tz_rule.dst_offset_min;
+    tz_window = {0, tz_table.at[0].utc, before * 60};
+  }
+  else
+  {
+    tz_window = {tz_table.at[lo - 1].utc, lo < tz_table.count ? tz_table.at[lo].utc : UINT32_MAX, tz_table.at[lo - 1].offset_min * 60};
+  }
+  return tz_window.offset_s;
+}
+
+time_t utc_to_local(time_t utc)
+{
+  return utc + tz_offset(utc);
+}
+
+// Wall clock times skipped by DST move forward, repeated ones resolve to the first.
+// The larger offset gives the earlier UTC, so it is tried first; when it does
+// not hold at that UTC, the smaller one is either the answer or, in a skipped
+// hour, lands after the change.
+time_t local_to_utc(time_t local)
+{
+  int32_t larger = max(tz_rule.std_offset_min, tz_rule.dst_offset_min) * 60;
+  int32_t smaller = min(tz_rule.std_offset_min, tz_rule.dst_offset_min) * 60;
+  if (tz_offset(local - larger) == larger)
+    return local - larger;
+  return local - smaller;
+}
+
+// Reads the RTC as local time; returns false if the bus read failed
+bool read_local_time(tmElements_t &local)
+{
+  time_t utc = rtc_get();
+  if (utc == 0)
+    return false;
+  breakTime(utc_to_local(utc), local);
+  return true;
+}
+
+void write_local_time(tmElements_t &local)
+{
+  time_t utc = local_to_utc(makeTime(local));
+  i2c_begin(RTC_ADDRESS);
+  RTC.set(utc);
+  i2c_end();
+  clock_set(utc);
+}
+
+/*
+   PackedLCD
+*/
+PackedLCD::PackedLCD(uint8_t address, uint8_t cols, uint8_t rows)
+    : address(address), cols(cols), rows(rows)
+{
+}
+
+void PackedLCD::init()
+{
+  delay(50); // power on
+
+  // Reset into 4-bit mode, see figure 24 of the HD44780 datasheet
+  const uint32_t reset_waits_us[] = {4500, 4500, 150};
+  for (uint32_t wait_us : reset_waits_us)
+  {
+    send_nibble(0x30);
+    flush();
+    delayMicroseconds(wait_us);
+  }
+  send_nibble(0x20);
+  flush();
+  delayMicroseconds(LCD_INSTRUCTION_US);
+
+  command(0x28); // 4-bit, 2 lines, 5x8 dots
+  command(0x0c); // display on, no cursor, no blink
+  command(0x06); // entry mode: increment, no shift
+  clear();
+}
+
+void PackedLCD::clear()
+{
+  command(0x01, LCD_CLEAR_US);
+}
+
+void PackedLCD::backlight()
+{
+  backlight_bit = LCD_BACKLIGHT;
+  transmit(&backlight_bit, 1);
+}
+
+void PackedLCD::noBacklight()
+{
+  backlight_bit = 0;
+  transmit(&backlight_bit, 1);
+}
+
+// Queued until the next write, so the cursor move shares its transaction
+void PackedLCD::setCursor(uint8_t col, uint8_t row)
+{
+  const uint8_t row_offsets[] = {0x00, 0x40, 0x14, 0x54};
+  if (row >= rows)
+    row = rows - 1;
+  command(0x80 | (col + row_offsets[row]));
+}
+
+void PackedLCD::createChar(uint8_t location, uint8_t charmap[])
+{
+  command(0x40 | ((location & 0x7) << 3));
+  for (int i = 0; i < 8; i++)
+    send(charmap[i], LCD_RS);
+  flush();
+}
+
+size_t PackedLCD::write(uint8_t value)
+{
+  send(value, LCD_RS);
+  flush();
+  return 1;
+}
+
+size_t PackedLCD::write(const uint8_t *data, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+    send(data[i], LCD_RS);
+  flush();
+  return size;
+}
+
+void PackedLCD::flush()
+{
+  if (length == 0)
+    return;
+
+  transmit(buffer, length);
+  length = 0;
+}
+
+void PackedLCD::command(uint8_t value, uint32_t exec_us)
+{
+  send(value, 0);
+  if (exec_us > LCD_INSTRUCTION_US)
+  {
+    flush();
+    ready_at_us = micros() + exec_us;
+  }
+}
+
+void PackedLCD::send(uint8_t value, uint8_t mode)
+{
+  send_nibble((value & 0xf0) | mode);
+  send_nibble((value << 4) | mode);
+}
+
+void PackedLCD::send_nibble(uint8_t bits)
+{
+  uint8_t strobe[2] = {
+      (uint8_t)(bits | backlight_bit | LCD_EN),
+      (uint8_t)(bits | backlight_bit)};
+
+  if (!packed)
+  {
+    uint8_t data = bits | backlight_bit;
+    transmit(&data, 1);
+    transmit(&strobe[0], 1);
+    delayMicroseconds(1);
+    transmit(&strobe[1], 1);
+    delayMicroseconds(50);
+    return;
+  }
+
+  if (length + sizeof(strobe) > LCD_BUFFER_SIZE)
+    flush();
+  buffer[length++] = strobe[0];
+  buffer[length++] = strobe[1];
+}
+
+void PackedLCD::transmit(const uint8_t *data, uint8_t size)
+{
+  while ((long)(ready_at_us - micros()) > 0)
+  {
+  }
+
+  i2c_begin(address);
+  Wire.beginTransmission(address);
+  Wire.write(data, size);
+  i2c_check(Wire.endTransmission());
+  i2c_end();
+}
+
+#ifdef LCD_BENCHMARK
+// Prints the LCD throughput with and without nibble packing
+void lcd_benchmark()
+{
+  const char *line = "0123456789ABCDEF";
+  const int runs = 20;
+
+  for (int packed = 0; packed < 2; packed++)
+  {
+    LCD.packed = packed;
+    LCD.clear();
+
+    unsigned long start = micros();
+    for (int i = 0; i < runs; i++)
+    {
+      LCD.setCursor(0, 0);
+      LCD.print(line);
+      LCD.setCursor(0, 1);
+      LCD.print(line);
+    }
+    unsigned long elapsed = micros() - start;
+
+    Serial.printf("LCD %s: %.0f chars/s, full frame %lu us\n",
+                  packed ? "packed" : "unpacked", runs * 32 * 1e6 / elapsed, elapsed / runs);
+  }
+
+  LCD.packed = true;
+  LCD.clear();
+}
+#endif
+
+void print_i2c_stats()
+{
+  static uint64_t last_busy_us = 0;
+  static unsigned long last_report_us = 0;
+
+  unsigned long now_us = micros();
+  float utilization = 100.0 * (i2c_stats.busy_us - last_busy_us) / (now_us - last_report_us);
+  last_busy_us = i2c_stats.busy_us;
+  last_report_us = now_us;
+
+  Serial.printf("I2C: %.1f%% busy, %u transactions, max %u us (wait %u us), %u NACK, %u timeout, %u error, %u bus clear\n",
+                utilization, i2c_stats.transactions, i2c_stats.latency_max_us, i2c_stats.wait_max_us,
+                i2c_stats.nacks, i2c_stats.timeouts, i2c_stats.errors, i2c_stats.bus_clears);
+}
+
+/*
+   UI allocations
+
+   malloc, calloc and realloc are wrapped at link time (see build_flags in
+   platformio.ini), and operator new goes through malloc, so every heap
+   allocation the UI task makes is counted here. Once each screen has been
+   shown, the count should stay flat: the UI task formats into stack
+   buffers and redraws from flash.
+*/
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t count, size_t size);
+extern "C" void *__real_realloc(void *ptr, size_t size);
+
+std::atomic<uint32_t> ui_allocations;
+
+inline void count_ui_allocation()
+{
+  if (Task0 && xTaskGetCurrentTaskHandle() == Task0)
+    ui_allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+extern "C" void *__wrap_malloc(size_t size)
+{
+  count_ui_allocation();
+  return __real_malloc(size);
+}
+
+extern "C" void *__wrap_calloc(size_t count, size_t size)
+{
+  count_ui_allocation();
+  return __real_calloc(count, size);
+}
+
+extern "C" void *__wrap_realloc(void *ptr, size_t size)
+{
+  count_ui_allocation();
+  return __real_realloc(ptr, size);
+}
+
+/*
+   Button scanner
+
+   All six buttons are sampled from one read of the GPIO input register and
+   debounced together by button_scan() from include/buttons.h.
+*/
+void IRAM_ATTR onButtonScan()
+{
+  uint32_t start = ESP.getCycleCount();
+  uint32_t gpio = REG_READ(GPIO_IN_REG);
+
+  uint8_t raw = 0;
+  for (int i = 0; i < BUTTON_COUNT; i++)
+  {
+    if (!(gpio & (1UL << button_pins[i]))) // active low, pulled up
+      raw |= 1 << i;
+  }
+
+  ButtonEvents events = {0, 0, 0, 0};
+  button_scan(button_scanner, raw, events);
+
+  portENTER_CRITICAL_ISR(&button_mux);
+  button_events.pressed |= events.pressed;
+  button_events.released |= events.released;
+  button_events.long_pressed |= events.long_pressed;
+  button_events.repeated |= events.repeated;
+  portEXIT_CRITICAL_ISR(&button_mux);
+
+  button_scan_cycles = ESP.getCycleCount() - start;
+  if (button_scan_cycles > button_scan_cycles_max)
+    button_scan_cycles_max = button_scan_cycles;
+}
+
+void begin_buttons()
+{
+  for (int i = 0; i < BUTTON_COUNT; i++)
+    pinMode(button_pins[i], INPUT_PULLUP);
+  button_scanner_init(button_scanner, BUTTON_REPEAT_MASK);
+
+  buttonScanTimer = timerBegin(2, 80, true);
+  timerAttachInterrupt(buttonScanTimer, &onButtonScan, true);
+  timerAlarmWrite(buttonScanTimer, BUTTON_SCAN_US, true);
+  timerAlarmEnable(buttonScanTimer);
+}
+
+// Returns the events latched since the previous call and clears them
+ButtonEvents read_button_events()
+{
+  ButtonEvents events;
+  portENTER_CRITICAL(&button_mux);
+  events.pressed = button_events.pressed;
+  events.released = button_events.released;
+  events.long_pressed = button_events.long_pressed;
+  events.repeated = button_events.repeated;
+  button_events.pressed = 0;
+  button_events.released = 0;
+  button_events.long_pressed = 0;
+  button_events.repeated = 0;
+  portEXIT_CRITICAL(&button_mux);
+  return events;
+}
+
+#define NET_CONNECT_ATTEMPTS 10 // a WiFi retry takes 5 s, an MQTT one up to the 15 s socket timeout
+
+void IRAM_ATTR onKeepAliveTimer()
+{
+  xSemaphoreGiveFromISR(sendKeepAliveSemaphore, NULL);
+}
+
+// Brings WiFi and MQTT up. It does not heartbeat, so a link that will not
+// come up shows as a missed deadline. It gives up after NET_CONNECT_ATTEMPTS
+// passes, or as soon as the supervisor wants the task restarted, and
+// returns false; the caller tries again on its next publish or keep-alive.
+bool WIFI_MQTT_connection()
+{
+  bool wifi_conn = false;
+  bool mqtt_conn = false;
+  int attempts = 0;
+  while (!wifi_conn || !mqtt_conn)
+  {
+    if (attempts++ == NET_CONNECT_ATTEMPTS || task_stop_pending())
+    {
+      Serial.println("Network: giving up for now");
+      return false;
+    }
+    // Check if WiFi is connected
+    if (WiFi.status() == WL_CONNECTED)
+    {
+      wifi_conn = true;
+      // Serial.println("WiFi still conneted");
+      // vTaskDelay(500/portTICK_PERIOD_MS);
+      // Check if MQTT Server is connected
+      if (!mqtt.connected())
+      {
+        count_metric(COUNTER_MQTT_RECONNECTS);
+        xSemaphoreTakeRecursive(mqtt_mutex, portMAX_DELAY);
+        if (mqtt.connect(clientID, mqttUserName, mqttPass))
+          mqtt.subscribe(COMMAND_TOPIC);
+        xSemaphoreGiveRecursive(mqtt_mutex);
+        postmortem_record(mqtt.connected() ? EVENT_MQTT_CONNECTED : EVENT_MQTT_LOST, mqtt.state());
+        if (!mqtt.connected())
+        {
+          mqtt_conn = false;
+          vTaskDelay(MQTT_RETRY_MS / portTICK_PERIOD_MS);
+          Serial.print(".");
+          continue;
+        }
+      }
+      mqtt_conn = true;
+    }
+    else
+    {
+      wifi_conn = false;
+      Serial.println("WiFi connecting");
+      count_metric(COUNTER_WIFI_RECONNECTS);
+      postmortem_record(EVENT_WIFI_LOST, WiFi.status());
+      WiFi.mode(WIFI_STA);
+      WiFi.begin(SSID, PASS);
+
+      unsigned long startAttemptTime = millis();
+      while (WiFi.status() != WL_CONNECTED && millis() - startAttemptTime < WIFI_EVENT_MAX)
+      {
+        vTaskDelay(10 / portTICK_PERIOD_MS); // lets the idle task on the radio core run
+      }
+      if (WiFi.status() != WL_CONNECTED)
+      {
+        Serial.println("WiFi Failed");
+        vTaskDelay(5000 / portTICK_PERIOD_MS);
+        continue;
+      }
+    }
+  }
+  return true;
+}
+
+/*
+   Delta OTA
+
+   OTA_URL (set it in secrets.h to enable updates) points at a delta made by
+   tools/make_ota_delta.py: a header naming the image it applies to and the
+   image it produces, followed by a zlib stream of COPY (from the running
+   image) and ADD (literal bytes) operations. The delta is inflated and
+   applied while it downloads, straight into the other app partition.
+*/
+#define OTA_MAGIC 0x544c4441 // "ADLT"
+#define OTA_OP_COPY 'C'
+#define OTA_OP_ADD 'A'
+#define OTA_OP_END 'E'
+#define OTA_VERIFY_TIMEOUT_MS 60000
+#ifndef OTA_CHECK_INTERVAL_MS
+#define OTA_CHECK_INTERVAL_MS 3600000 // an HTTP request per keep-alive is too many
+#endif
+#define OTA_READ_TIMEOUT_MS 10000
+
+struct __attribute__((packed)) OtaDeltaHeader
+{
+  uint32_t magic;
+  uint32_t base_size;
+  uint8_t base_md5[16];
+  uint32_t target_size;
+  uint8_t target_md5[16];
+};
+
+struct OtaDeltaParser
+{
+  uint8_t op;
+  uint8_t args[8];
+  uint8_t args_length;
+  uint32_t literal_remaining;
+  bool done;
+};
+
+// Keep a freshly updated image in PENDING_VERIFY until it reaches the main
+// screen instead of letting the core accept it right after boot
+extern "C" bool verifyRollbackLater()
+{
+  return true;
+}
+
+void ota_begin_verify()
+{
+  esp_ota_img_states_t ota_state;
+  if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &ota_state) == ESP_OK)
+    ota_pending_verify = ota_state == ESP_OTA_IMG_PENDING_VERIFY;
+}
+
+void ota_confirm_boot()
+{
+  if (!ota_pending_verify)
+    return;
+
+  esp_ota_mark_app_valid_cancel_rollback();
+  ota_pending_verify = false;
+  Serial.println("OTA: new firmware confirmed");
+}
+
+void ota_check_verify_deadline()
+{
+  if (ota_pending_verify && millis() > OTA_VERIFY_TIMEOUT_MS)
+  {
+    Serial.println("OTA: main screen not reached, rolling back");
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+  }
+}
+
+#ifdef METRICS_TOPIC
+// ThingSpeak only accepts its channel topics, so this needs a broker that
+// allows METRICS_TOPIC
+void publish_metrics_summary()
+{
+  char summary[192];
+  snprintf(summary, sizeof(summary),
+           "pub_ok=%u pub_fail=%u mqtt_rc=%u wifi_rc=%u pm_err=%u dht_err=%u alarms=%u i2c_err=%u heap=%u up=%lu",
+           counters[COUNTER_MQTT_PUBLISH_OK].load(), counters[COUNTER_MQTT_PUBLISH_FAILED].load(),
+           counters[COUNTER_MQTT_RECONNECTS].load(), counters[COUNTER_WIFI_RECONNECTS].load(),
+           counters[COUNTER_PM_HEADER_ERRORS].load(), counters[COUNTER_DHT_FAILURES].load(),
+           counters[COUNTER_ALARM_FIRINGS].load(), i2c_stats.nacks + i2c_stats.timeouts + i2c_stats.errors,
+           ESP.getFreeHeap(), millis() / 1000);
+  publish_mqtt(METRICS_TOPIC, summary);
+}
+#endif
+
+#ifdef OTA_URL
+void md5_to_hex(const uint8_t *md5, char *hex)
+{
+  for (int i = 0; i < 16; i++)
+    sprintf(hex + i * 2, "%02x", md5[i]);
+}
+
+uint32_t read_le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool ota_copy_from_running(uint32_t offset, uint32_t length)
+{
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  uint8_t chunk[512];
+
+  while (length > 0)
+  {
+    uint32_t n = length < sizeof(chunk) ? length : sizeof(chunk);
+    if (esp_partition_read(running, offset, chunk, n) != ESP_OK)
+      return false;
+    if (Update.write(chunk, n) != n)
+      return false;
+    offset += n;
+    length -= n;
+  }
+  return true;
+}
+
+// Feeds inflated delta bytes through the COPY/ADD interpreter
+bool ota_apply(OtaDeltaParser &parser, uint8_t *data, size_t length)
+{
+  while (length > 0 && !parser.done)
+  {
+    if (parser.literal_remaining > 0)
+    {
+      size_t n = length < parser.literal_remaining ? length : parser.literal_remaining;
+      if (Update.write(data, n) != n)
+        return false;
+      data += n;
+      length -= n;
+      parser.literal_remaining -= n;
+      continue;
+    }
+
+    if (parser.op == 0)
+    {
+      parser.op = *data++;
+      length--;
+      parser.args_length = 0;
+      if (parser.op == OTA_OP_END)
+        parser.done = true;
+      else if (parser.op != OTA_OP_COPY && parser.op != OTA_OP_ADD)
+        return false;
+      continue;
+    }
+
+    uint8_t args_needed = parser.op == OTA_OP_COPY ? 8 : 4;
+    while (parser.args_length < args_needed && length > 0)
+    {
+      parser.args[parser.args_length++] = *data++;
+      length--;
+    }
+    if (parser.args_length < args_needed)
+      break;
+
+    if (parser.op == OTA_OP_COPY)
+    {
+      if (!ota_copy_from_running(read_le32(parser.args), read_le32(parser.args + 4)))
+        return false;
+    }
+    else
+    {
+      parser.literal_remaining = read_le32(parser.args);
+    }
+    parser.op = 0;
+  }
+  return true;
+}
+
+// Downloads OTA_URL and applies it if it is a delta against the running
+// image. Restarts into the new image on success.
+void ota_check()
+{
+  WiFiClient ota_client;
+  HTTPClient http;
+  http.begin(ota_client, OTA_URL);
+  if (http.GET() != HTTP_CODE_OK)
+  {
+    http.end();
+    return;
+  }
+
+  WiFiClient *stream = http.getStreamPtr();
+  OtaDeltaHeader header;
+  char md5[33];
+  stream->setTimeout(OTA_READ_TIMEOUT_MS);
+  if (stream->readBytes((uint8_t *)&header, sizeof(header)) != sizeof(header) || header.magic != OTA_MAGIC)
+  {
+    http.end();
+    return;
+  }
+
+  // A delta for another build, or the one we are already running
+  md5_to_hex(header.base_md5, md5);
+  if (header.base_size != ESP.getSketchSize() || !ESP.getSketchMD5().equals(md5))
+  {
+    http.end();
+    return;
+  }
+
+  Serial.println("OTA: applying delta");
+  unsigned long start = millis();
+  uint32_t transferred = sizeof(header);
+
+  tinfl_decompressor *inflator = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+  uint8_t *dict = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+  uint8_t in[512];
+  size_t in_offset = 0, in_length = 0, dict_offset = 0;
+  OtaDeltaParser parser = {};
+
+  md5_to_hex(header.target_md5, md5);
+  bool ok = inflator && dict && Update.begin(header.target_size);
+  if (ok)
+  {
+    Update.setMD5(md5);
+    tinfl_init(inflator);
+  }
+
+  while (ok && !parser.done)
+  {
+    heartbeat();
+    if (in_offset == in_length)
+    {
+      in_length = stream->readBytes(in, sizeof(in));
+      in_offset = 0;
+      transferred += in_length;
+      if (in_length == 0)
+      {
+        ok = false; // connection closed or stalled before the END op
+        break;
+      }
+    }
+
+    size_t in_bytes = in_length - in_offset;
+    size_t out_bytes = TINFL_LZ_DICT_SIZE - dict_offset;
+    tinfl_status status = tinfl_decompress(inflator, in + in_offset, &in_bytes, dict, dict + dict_offset, &out_bytes,
+                                           TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+    in_offset += in_bytes;
+    ok = status >= TINFL_STATUS_DONE && ota_apply(parser, dict + dict_offset, out_bytes);
+    dict_offset = (dict_offset + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+    if (status == TINFL_STATUS_DONE)
+      break;
+  }
+
+  free(inflator);
+  free(dict);
+  http.end();
+
+  ok = ok && parser.done && Update.end(); // checks the MD5 and selects the new partition
+  if (!ok)
+    Update.abort();
+
+  Serial.printf("OTA: %s, %u bytes transferred for a %u byte image in %lu ms\n",
+                ok ? "done" : "failed", transferred, header.target_size, millis() - start);
+  if (ok)
+  {
+    postmortem_record(EVENT_REBOOT, 0xff);
+    ESP.restart();
+  }
+}
+#endif
+
+// Turns "[#id] verb args" into a Command. The id is echoed in the
+// acknowledgement, without the '#', so the sender can match it up.
+bool parse_command(char *text, Command &command)
+{
+  char *verb = strtok(text, " ");
+  command.id[0] = '\0';
+  if (verb && verb[0] == COMMAND_ID_PREFIX)
+  {
+    if (!verb[1])
+      return false;
+    strlcpy(command.id, verb + 1, sizeof(command.id));
+    verb = strtok(NULL, " ");
+  }
+  if (!verb)
+    return false;
+
+  char *arg = strtok(NULL, " ");
+  unsigned h = 0, m = 0;
+
+  if (strcmp(verb, "alarm") == 0 && arg)
+  {
+    if (strcmp(arg, "on") == 0)
+      command.type = COMMAND_ALARM_ON;
+    else if (strcmp(arg, "off") == 0)
+      command.type = COMMAND_ALARM_OFF;
+    else if (strcmp(arg, "toggle") == 0)
+      command.type = COMMAND_ALARM_TOGGLE;
+    else if (sscanf(arg, "%u:%u", &h, &m) == 2 && h < 24 && m < 60)
+      command.type = COMMAND_SET_ALARM;
+    else
+      return false;
+  }
+  else if (strcmp(verb, "time") == 0 && arg && sscanf(arg, "%u:%u", &h, &m) == 2 && h < 24 && m < 60)
+  {
+    command.type = COMMAND_SET_TIME;
+  }
+  else if (strcmp(verb, "interval") == 0 && arg && sscanf(arg, "%u", &h) == 1 && h >= 15)
+  {
+    // Optional second argument: the fastest rate when readings need attention
+    char *fastest = strtok(NULL, " ");
+    m = h;
+    if (fastest && (sscanf(fastest, "%u", &m) != 1 || m < 15 || m > h))
+      return false;
+    command.type = COMMAND_PUBLISH_INTERVAL;
+  }
+  else
+  {
+    return false;
+  }
+
+  command.args[0] = h;
+  command.args[1] = m;
+  return true;
+}
+
+// Runs inside mqtt.loop() on the keep-alive task
+void on_mqtt_message(char *topic, uint8_t *payload, unsigned int length)
+{
+  char text[64];
+  length = length < sizeof(text) - 1 ? length : sizeof(text) - 1;
+  memcpy(text, payload, length);
+  text[length] = '\0';
+
+  // ThingSpeak echoes every channel update on the field topic, including the
+  // clock's own publishes with the field empty. Acknowledging those would
+  // publish another update and loop, so anything that does not parse is
+  // dropped without a reply.
+  Command command = {};
+  command.received_ms = millis();
+  if (!parse_command(text, command))
+  {
+    count_metric(COUNTER_COMMANDS_DROPPED);
+    return;
+  }
+  if (xQueueSend(command_queue, &command, 0) != pdTRUE)
+  {
+    CommandAck ack = {};
+    strlcpy(ack.id, command.id, sizeof(ack.id));
+    ack.received_ms = command.received_ms;
+    xQueueSend(command_ack_queue, &ack, 0);
+  }
+}
+
+// Called from the FSM task between ticks, so commands never race the UI.
+// The SET_* screens edit clock_settings in place and write it back on OK,
+// so commands wait in the queue until the edit is saved, cancelled or
+// times out; otherwise the edit would overwrite them with its stale copy.
+void process_commands()
+{
+  if (state >= SET_HOUR && state <= SET_ALARM_ON_OFF)
+    return;
+
+  Command command;
+  while (xQueueReceive(command_queue, &command, 0) == pdTRUE)
+  {
+    switch (command.type)
+    {
+    case COMMAND_SET_ALARM:
+      get_alarm();
+      clock_settings.alarm.hour = command.args[0];
+      clock_settings.alarm.minute = command.args[1];
+      set_alarm();
+      break;
+    case COMMAND_ALARM_ON:
+    case COMMAND_ALARM_OFF:
+    case COMMAND_ALARM_TOGGLE:
+      get_alarm();
+      clock_settings.alarm.active = command.type == COMMAND_ALARM_TOGGLE ? !clock_settings.alarm.active
+                                                                         : command.type == COMMAND_ALARM_ON;
+      set_alarm();
+      break;
+    case COMMAND_SET_TIME:
+      clock_settings.time.hour = command.args[0];
+      clock_settings.time.minute = command.args[1];
+      set_time();
+      break;
+    case COMMAND_PUBLISH_INTERVAL:
+      publish_interval_s = command.args[0];
+      publish_min_interval_s = command.args[1];
+      break;
+    }
+
+    CommandAck ack = {};
+    strlcpy(ack.id, command.id, sizeof(ack.id));
+    ack.ok = true;
+    ack.received_ms = command.received_ms;
+    xQueueSend(command_ack_queue, &ack, 0);
+  }
+}
+
+void service_mqtt()
+{
+  xSemaphoreTakeRecursive(mqtt_mutex, portMAX_DELAY);
+  mqtt.loop();
+  xSemaphoreGiveRecursive(mqtt_mutex);
+
+  CommandAck ack;
+  while (xQueueReceive(command_ack_queue, &ack, 0) == pdTRUE)
+  {
+    char payload[48];
+    snprintf(payload, sizeof(payload), COMMAND_ACK_FORMAT, ack.id[0] ? ack.id : "-", ack.ok ? "ok" : "error");
+    publish_mqtt(COMMAND_ACK_TOPIC, payload);
+    observe_metric(HISTOGRAM_COMMAND_MS, millis() - ack.received_ms);
+  }
+}
+
+// How often keep_alive_task services MQTT between keep-alives. Incoming
+// commands and their acks wait at most this long; a shorter wait only burns
+// CPU on a socket that is almost always empty.
+#define MQTT_SERVICE_MS 100
+
+void keep_alive_task(void *parameter)
+{
+  for (;;)
+  {
+    static bool firstrun = true;
+    if (firstrun)
+    {                                       // setup for this task
+      vTaskDelay(200 / portTICK_PERIOD_MS); // to let other task do first
+      firstrun = false;
+      postmortem_dump();
+      xSemaphoreGive(sendKeepAliveSemaphore);
+      timerAlarmEnable(keepAlive);
+    }
+
+    if (xSemaphoreTake(sendKeepAliveSemaphore, pdMS_TO_TICKS(MQTT_SERVICE_MS)) == pdTRUE)
+    {
+      if (WIFI_MQTT_connection())
+      {
+        char topic[64];
+        format_publish_topic(topic, sizeof(topic), channelID);
+        publish_mqtt(topic, KEEP_ALIVE_PAYLOAD);
+        Serial.println(KEEP_ALIVE_PAYLOAD);
+#ifdef POSTMORTEM_TOPIC
+        static bool postmortem_sent = false;
+        if (!postmortem_sent)
+          postmortem_sent = publish_postmortem();
+#endif
+#ifdef METRICS_TOPIC
+        publish_metrics_summary();
+#endif
+      }
+      report_tick_jitter();
+      report_cpu_usage();
+#ifdef DEBUG_STATS
+      // At 9600 baud these lines hold this task for about half a second;
+      // the same numbers are on /metrics
+      Serial.printf("Button scan: %u cycles, max %u\n", button_scan_cycles, button_scan_cycles_max);
+      Serial.printf("CGRAM uploads: %u\n", cgram_uploads);
+      Serial.printf("UI allocations: %u\n", ui_allocations.load());
+      print_i2c_stats();
+      print_log_stats();
+#ifdef SERIAL_TELEMETRY
+      Serial.printf("Telemetry: %u frames, %u dropped, %u bytes\n",
+                    telemetry_stats.frames, telemetry_stats.dropped, telemetry_stats.bytes);
+#endif
+#endif
+#ifdef OTA_URL
+      static bool ota_checked = false;
+      static unsigned long ota_checked_ms;
+      if (!ota_checked || millis() - ota_checked_ms >= OTA_CHECK_INTERVAL_MS)
+      {
+        ota_checked = true;
+        ota_checked_ms = millis();
+        ota_check();
+      }
+#endif
+    }
+
+    service_mqtt();
+    task_safe_point();
+  }
+}
+
+/*
+   Alarm
+
+   The DS3231 pulls SQW low when alarm 1 matches. The interrupt wakes
+   alarm_task, which outranks every other task on its core, so the buzzer
+   turns on one context switch after the edge whatever the FSM is doing,
+   even in the middle of a splash screen. The time from the interrupt to the
+   buzzer is recorded with its maximum. Only then is the RTC asked whether
+   the alarm really fired, which also releases SQW.
+
+   While it rings, the UI task runs alarm_screen() instead of the FSM. The
+   screen flashes with the buzzer, OK stops it, and afterwards the FSM goes
+   back to MAIN from whichever state it was in.
+*/
+#define ALARM_BEEPS 25
+#define ALARM_BEEP_MS 500
+
+TaskHandle_t alarm_task_handle = NULL;
+volatile uint32_t alarm_isr_us = 0;
+volatile bool alarm_ringing = false;
+volatile bool alarm_buzzer_on = false;
+uint32_t alarm_latency_us = 0; // of the last alarm
+uint32_t alarm_latency_max_us = 0;
+
+void IRAM_ATTR alarm_isr()
+{
+  alarm_isr_us = micros();
+  BaseType_t woken = pdFALSE;
+  if (alarm_task_handle)
+    vTaskNotifyGiveFromISR(alarm_task_handle, &woken);
+  if (woken)
+    portYIELD_FROM_ISR();
+}
+
+void buzzer(bool on)
+{
+  digitalWrite(ALARM_OUT, on ? HIGH : LOW);
+  alarm_buzzer_on = on;
+}
+
+void dismiss_alarm()
+{
+  alarm_ringing = false;
+  xTaskNotifyGive(alarm_task_handle);
+}
+
+void alarm_task(void *parameter)
+{
+  // An alarm that fired during boot left SQW low without an edge to catch
+  if (digitalRead(SQW_PIN) == LOW)
+  {
+    alarm_isr_us = micros();
+    xTaskNotifyGive(xTaskGetCurrentTaskHandle());
+  }
+
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    buzzer(true);
+    uint32_t latency_us = micros() - alarm_isr_us;
+
+    i2c_begin(RTC_ADDRESS);
+    bool alarm_fired = RTC.alarm(DS3232RTC::ALARM_1);
+    i2c_end();
+    if (!alarm_fired)
+    {
+      buzzer(false);
+      continue;
+    }
+
+    alarm_latency_us = latency_us;
+    if (latency_us > alarm_latency_max_us)
+      alarm_latency_max_us = latency_us;
+    observe_metric(HISTOGRAM_ALARM_LATENCY_US, latency_us);
+    count_metric(COUNTER_ALARM_FIRINGS);
+    Serial.printf("Alarm: buzzer on %u us after the interrupt (max %u us)\n", latency_us, alarm_latency_max_us);
+
+    // dismiss_alarm() cuts the waits short
+    alarm_ringing = true;
+    for (int i = 0; i < ALARM_BEEPS && alarm_ringing; i++)
+    {
+      buzzer(true);
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ALARM_BEEP_MS));
+      buzzer(false);
+      if (alarm_ringing)
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ALARM_BEEP_MS));
+    }
+    alarm_ringing = false;
+    ulTaskNotifyTake(pdTRUE, 0); // a late dismissal is not a new alarm
+  }
+}
+
+// Runs in place of the FSM while the alarm rings; returns false otherwise
+bool alarm_screen()
+{
+  static bool showing = false;
+  static bool backlight_off = false;
+
+  if (!alarm_ringing && !showing)
+    return false;
+
+  if (!showing)
+  {
+    showing = true;
+    LCD.clear();
+    LCD.setCursor(5, 0);
+    LCD.print("ALARM");
+    read_button_events(); // drop presses made before it rang
+  }
+
+  if (alarm_ringing)
+  {
+    if (backlight_off != alarm_buzzer_on)
+    {
+      backlight_off = alarm_buzzer_on;
+      backlight_off ? LCD.noBacklight() : LCD.backlight();
+    }
+    if (read_button_events().pressed & BUTTON_BIT(BUTTON_OK))
+      dismiss_alarm();
+    return true;
+  }
+
+  showing = false;
+  backlight_off = false;
+  LCD.backlight();
+  LCD.clear();
+  not_AFK();
+  fsm.trigger(ALARM_DISMISSED);
+  return true;
+}
+
+/*
+   FSM tick jitter
+
+   Measures the period between tick starts against FSM_TICK_MS. The keep-alive
+   report prints the window and starts a new one.
+*/
+#define FSM_TICK_MS 100
+
+struct TickJitter
+{
+  uint32_t ticks;
+  int64_t sum_us;    // deviation from FSM_TICK_MS
+  uint64_t sum_sq_us;
+  int32_t min_us;
+  int32_t max_us;
+};
+
+TickJitter tick_jitter = {0, 0, 0, INT32_MAX, INT32_MIN};
+TickJitter tick_jitter_last = {0, 0, 0, 0, 0}; // the last full window, for /metrics
+portMUX_TYPE tick_jitter_mux = portMUX_INITIALIZER_UNLOCKED;
+
+void record_tick_period(uint32_t period_us)
+{
+  int32_t deviation = (int32_t)period_us - FSM_TICK_MS * 1000;
+
+  portENTER_CRITICAL(&tick_jitter_mux);
+  tick_jitter.ticks++;
+  tick_jitter.sum_us += deviation;
+  tick_jitter.sum_sq_us += (int64_t)deviation * deviation;
+  tick_jitter.min_us = min(tick_jitter.min_us, deviation);
+  tick_jitter.max_us = max(tick_jitter.max_us, deviation);
+  portEXIT_CRITICAL(&tick_jitter_mux);
+}
+
+float tick_jitter_stddev_us(const TickJitter &jitter)
+{
+  if (jitter.ticks < 2)
+    return 0;
+  double mean = (double)jitter.sum_us / jitter.ticks;
+  return sqrt(max((double)jitter.sum_sq_us / jitter.ticks - mean * mean, 0.0));
+}
+
+// Closes the window /metrics reports, and prints it in debug builds
+void report_tick_jitter()
+{
+  portENTER_CRITICAL(&tick_jitter_mux);
+  tick_jitter_last = tick_jitter;
+  tick_jitter = {0, 0, 0, INT32_MAX, INT32_MIN};
+  portEXIT_CRITICAL(&tick_jitter_mux);
+
+#ifdef DEBUG_STATS
+  if (tick_jitter_last.ticks == 0)
+    return;
+  Serial.printf("FSM tick: %u ticks, period %+lld us mean, %.0f us stddev, %+d..%+d us\n",
+                tick_jitter_last.ticks, tick_jitter_last.sum_us / tick_jitter_last.ticks,
+                tick_jitter_stddev_us(tick_jitter_last), tick_jitter_last.min_us, tick_jitter_last.max_us);
+#endif
+}
+
+void alarm_clock_task(void *parameter)
+{
+  TickType_t last_wake = xTaskGetTickCount();
+  unsigned long last_tick_us = micros();
+  bool first = true;
+
+  for (;;)
+  {
+    unsigned long tick_start_us = micros();
+    uint32_t period_us = first ? 0 : tick_start_us - last_tick_us;
+    if (!first)
+      record_tick_period(period_us);
+    last_tick_us = tick_start_us;
+    first = false;
+
+    unsigned long tick_start = millis();
+    if (!alarm_screen())
+      fsm.run_machine();
+    observe_metric(HISTOGRAM_FSM_TICK_MS, millis() - tick_start);
+#ifdef SERIAL_TELEMETRY
+    telemetry_tick(period_us, micros() - tick_start_us);
+#endif
+    process_commands();
+    record_sensor_history();
+    task_safe_point();
+
+    // A fixed period instead of a fixed sleep; after a long tick such as a
+    // splash screen, start over instead of running the missed ticks back to back
+    if (xTaskGetTickCount() - last_wake >= pdMS_TO_TICKS(FSM_TICK_MS))
+      last_wake = xTaskGetTickCount();
+    vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(FSM_TICK_MS));
+  }
+}
+
+/*
+   CPU utilization
+
+   Busy time per core comes from the FreeRTOS run-time counters of the two
+   idle tasks, IDLE0 and IDLE1. The idle task is charged for the time its
+   core sleeps in waiti, and every other task for exactly the time it ran,
+   so work that starts and finishes between two ticks, such as a
+   vTaskDelay() poll loop, is counted too. Every second the supervisor turns
+   the idle time into a busy percentage per core and keeps the last
+   CPU_WINDOW_S of them, so the load is reported over 1, 10 and 60 s
+   windows. The per-task shares come from the same counters and are taken
+   over the interval between two reports.
+
+   The counters need a core built with CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+   and CONFIG_FREERTOS_USE_TRACE_FACILITY. Without them the load reads -1.
+*/
+#define CPU_WINDOW_S 60
+#define CPU_MAX_TASKS 24
+#define CPU_STATS (configGENERATE_RUN_TIME_STATS && configUSE_TRACE_FACILITY)
+
+struct CpuUsage
+{
+  TaskHandle_t idle_task;
+  uint32_t idle_time; // run-time counter of idle_task at the previous sample
+  uint8_t busy[CPU_WINDOW_S];
+};
+
+CpuUsage cpu_usage[portNUM_PROCESSORS];
+int cpu_window_head = 0;
+int cpu_window_count = 0;
+unsigned long cpu_sample_ms = 0;
+
+void cpu_usage_begin()
+{
+  for (int core = 0; core < portNUM_PROCESSORS; core++)
+    cpu_usage[core].idle_task = xTaskGetIdleTaskHandleForCPU(core);
+  cpu_sample_ms = millis();
+}
+
+// Called by the supervisor on every pass; samples once a second
+void cpu_usage_sample()
+{
+#if CPU_STATS
+  static TaskStatus_t status[CPU_MAX_TASKS];
+  static uint32_t last_total = 0;
+
+  unsigned long now_ms = millis();
+  if (now_ms - cpu_sample_ms < 1000)
+    return;
+  cpu_sample_ms = now_ms;
+
+  // total is the run-time clock, which every core's tasks share out
+  uint32_t total;
+  int count = uxTaskGetSystemState(status, CPU_MAX_TASKS, &total);
+  uint32_t elapsed = total - last_total;
+  bool first = last_total == 0;
+  last_total = total;
+
+  for (int core = 0; core < portNUM_PROCESSORS; core++)
+  {
+    CpuUsage &usage = cpu_usage[core];
+    for (int i = 0; i < count; i++)
+    {
+      if (status[i].xHandle != usage.idle_task)
+        continue;
+      uint32_t idle = status[i].ulRunTimeCounter - usage.idle_time;
+      usage.idle_time = status[i].ulRunTimeCounter;
+      usage.busy[cpu_window_head] = elapsed && idle < elapsed ? 100 - idle * 100ULL / elapsed : 0;
+    }
+  }
+  if (first)
+    return; // the first sample only sets the baseline
+
+  cpu_window_head = (cpu_window_head + 1) % CPU_WINDOW_S;
+  if (cpu_window_count < CPU_WINDOW_S)
+    cpu_window_count++;
+#endif
+}
+
+// Mean busy percentage of a core over the last seconds, -1 before the first sample
+int cpu_busy(int core, int seconds)
+{
+  int count = min(seconds, cpu_window_count);
+  if (count == 0)
+    return -1;
+
+  uint32_t sum = 0;
+  for (int i = 1; i <= count; i++)
+    sum += cpu_usage[core].busy[(cpu_window_head - i + CPU_WINDOW_S) % CPU_WINDOW_S];
+  return sum / count;
+}
+
+#if CPU_STATS
+struct TaskLoad
+{
+  TaskHandle_t handle;
+  const char *name;
+  uint32_t run_time; // counter at the previous report
+  float percent;     // of one core since the previous report
+};
+
+TaskLoad task_loads[CPU_MAX_TASKS];
+int task_load_count = 0;
+
+// Refreshes task_loads from the run-time counters; one caller only
+void update_task_loads()
+{
+  static TaskStatus_t status[CPU_MAX_TASKS];
+  static uint32_t last_total = 0;
+
+  uint32_t total;
+  int count = uxTaskGetSystemState(status, CPU_MAX_TASKS, &total);
+  uint32_t elapsed = total - last_total;
+  last_total = total;
+
+  TaskLoad loads[CPU_MAX_TASKS];
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t previous = 0;
+    for (int j = 0; j < task_load_count; j++)
+      if (task_loads[j].handle == status[i].xHandle)
+        previous = task_loads[j].run_time;
+
+    uint32_t run_time = status[i].ulRunTimeCounter;
+    loads[i] = {status[i].xHandle, status[i].pcTaskName, run_time,
+                elapsed ? (run_time - previous) * 100.0f / elapsed : 0};
+  }
+
+  memcpy(task_loads, loads, count * sizeof(TaskLoad));
+  task_load_count = count;
+}
+#endif
+
+#ifdef CPU_TOPIC
+// One line of name=percent pairs, cores first
+void publish_cpu_usage()
+{
+  char line[384];
+  int length = snprintf(line, sizeof(line), "core0=%d core1=%d", cpu_busy(0, 60), cpu_busy(1, 60));
+#if CPU_STATS
+  for (int i = 0; i < task_load_count && length < sizeof(line); i++)
+    length += snprintf(line + length, sizeof(line) - length, " %s=%.1f", task_loads[i].name, task_loads[i].percent);
+#endif
+  publish_mqtt(CPU_TOPIC, line);
+}
+#endif
+
+// Takes the per-task shares since the previous report, prints them in
+// debug builds and publishes them on CPU_TOPIC
+void report_cpu_usage()
+{
+#if CPU_STATS
+  update_task_loads();
+#endif
+
+#ifdef DEBUG_STATS
+  for (int core = 0; core < portNUM_PROCESSORS; core++)
+    Serial.printf("CPU core %d: %d%% (1 s), %d%% (10 s), %d%% (60 s)\n",
+                  core, cpu_busy(core, 1), cpu_busy(core, 10), cpu_busy(core, 60));
+#if CPU_STATS
+  for (int i = 0; i < task_load_count; i++)
+    Serial.printf("  %-16s %5.1f%%\n", task_loads[i].name, task_loads[i].percent);
+#endif
+#endif
+
+#ifdef CPU_TOPIC
+  publish_cpu_usage();
+#endif
+}
+
+/*
+   Task supervisor
+
+   Every task calls task_safe_point() once per loop, where it holds no lock,
+   socket or buffer; long waits inside a loop call heartbeat() instead. A
+   task that misses its deadline is logged together with the FSM state at
+   that moment. Once restart_after_ms has passed it is asked to stop. Loops
+   that retry without a safe point, such as reconnecting, check
+   task_stop_pending() and unwind to their safe point, where the task parks
+   itself; the supervisor deletes it only once it sees it suspended there,
+   and starts it again. A task that reaches its safe point without having
+   unwound got past the stall by itself, so the request is dropped. A task
+   that does neither within TASK_STOP_TIMEOUT_MS is stuck somewhere it
+   cannot be deleted from, such as inside lwIP, so the clock reboots
+   instead. It also reboots after reboot_after_ms. The task watchdog is the
+   backstop if the supervisor itself stops running.
+*/
+#define SUPERVISOR_PERIOD_MS 50
+#define TASK_WDT_TIMEOUT_S 60
+#define TASK_STOP_TIMEOUT_MS 10000
+#define TASK_REAP_TIMEOUT_MS 1000
+#define STACK_DEPTH(stack) (sizeof(stack) / sizeof(stack[0]))
+
+struct SupervisedTask
+{
+  const char *name;
+  TaskFunction_t function;
+  uint32_t stack_words;
+  UBaseType_t priority;
+  BaseType_t core;
+  TaskHandle_t *handle;
+  uint32_t deadline_ms;
+  uint32_t restart_after_ms; // 0 = never restart, only reboot
+  uint32_t reboot_after_ms;
+  StackType_t *stack; // STACK_DEPTH(stack) == stack_words
+  StaticTask_t *tcb;
+
+  volatile unsigned long last_beat;
+  volatile bool stop_requested;
+  volatile bool unwinding; // it saw the request in task_stop_pending()
+  volatile bool parked;    // suspended at its safe point, ready to delete
+  unsigned long stop_requested_ms;
+  bool late;
+  bool restarted;
+  uint32_t violations;
+  uint32_t restarts;
+  uint32_t worst_ms;
+  STATES late_state;
+};
+
+/*
+   Core and priority plan
+
+   The WiFi driver and the lwIP stack are pinned to core 0, so the UI runs
+   alone on core 1 where radio interrupts cannot delay a tick. The network
+   tasks sit next to the stack they block on. The UI outranks publishing, so
+   a slow publish never holds up the clock, and the supervisor outranks
+   everything it watches. The alarm task outranks them all, since it only
+   runs to switch the buzzer. Override the cores with build flags to compare.
+*/
+#ifndef UI_CORE
+#define UI_CORE 1
+#endif
+#ifndef NET_CORE
+#define NET_CORE 0
+#endif
+#define ALARM_PRIORITY 5
+#define SUPERVISOR_PRIORITY 4
+#define UI_PRIORITY 3
+#define PUBLISH_PRIORITY 1
+#define NET_PRIORITY 1
+
+/*
+   Task stacks and control blocks are static, so they show up in the size
+   report and a restart reuses the same memory instead of allocating it
+   again from a heap that may have fragmented since boot.
+*/
+StackType_t alarm_clock_stack[5120], send_mqtt_stack[5120], keep_alive_stack[5120];
+StackType_t http_stack[4096], sensor_log_stack[4096];
+StackType_t supervisor_stack[3072], alarm_stack[2048];
+StaticTask_t alarm_clock_tcb, send_mqtt_tcb, keep_alive_tcb, http_tcb, sensor_log_tcb;
+StaticTask_t supervisor_tcb, alarm_tcb;
+
+SupervisedTask supervised_tasks[] = {
+    {"alarm_clock_task", alarm_clock_task, STACK_DEPTH(alarm_clock_stack), UI_PRIORITY, UI_CORE, &Task0, 150, 0, 45000,
+     alarm_clock_stack, &alarm_clock_tcb},
+    {"send_mqtt_task", send_mqtt_task, STACK_DEPTH(send_mqtt_stack), PUBLISH_PRIORITY, NET_CORE, &Task1, 30000, 60000,
+     300000, send_mqtt_stack, &send_mqtt_tcb},
+    {"keep_alive_task", keep_alive_task, STACK_DEPTH(keep_alive_stack), NET_PRIORITY, NET_CORE, &Task2, 30000, 60000,
+     300000, keep_alive_stack, &keep_alive_tcb},
+    {"http_task", http_task, STACK_DEPTH(http_stack), NET_PRIORITY, NET_CORE, &Task3, 10000, 20000, 300000, http_stack,
+     &http_tcb},
+    {"sensor_log_task", sensor_log_task, STACK_DEPTH(sensor_log_stack), NET_PRIORITY, NET_CORE, &Task5, 30000, 60000,
+     300000, sensor_log_stack, &sensor_log_tcb},
+};
+
+#define SUPERVISED_TASK_COUNT (sizeof(supervised_tasks) / sizeof(supervised_tasks[0]))
+
+std::atomic<uint32_t> deadline_violations[STATE_COUNT];
+
+SupervisedTask *current_supervised_task()
+{
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  for (SupervisedTask &task : supervised_tasks)
+  {
+    if (*task.handle == self)
+      return &task;
+  }
+  return NULL;
+}
+
+void heartbeat()
+{
+  SupervisedTask *task = current_supervised_task();
+  if (task)
+  {
+    task->last_beat = millis();
+    esp_task_wdt_reset();
+  }
+}
+
+// A heartbeat where the task holds nothing that would leak or deadlock if it
+// ended here, which is where it ends when the supervisor asks for a restart
+void task_safe_point()
+{
+  SupervisedTask *task = current_supervised_task();
+  if (!task)
+    return;
+  if (task->stop_requested && !task->unwinding)
+  {
+    task->stop_requested = false;
+    Serial.printf("Supervisor: %s recovered by itself\n", task->name);
+  }
+  else if (task->stop_requested)
+  {
+    esp_task_wdt_delete(NULL);
+    task->parked = true;
+    for (;;)
+      vTaskSuspend(NULL);
+  }
+  task->last_beat = millis();
+  esp_task_wdt_reset();
+}
+
+// For loops that retry without passing a safe point: true once the
+// supervisor wants the task restarted, and the loop should return to it
+bool task_stop_pending()
+{
+  SupervisedTask *task = current_supervised_task();
+  if (!task || !task->stop_requested)
+    return false;
+  task->unwinding = true;
+  return true;
+}
+
+void start_task(SupervisedTask &task)
+{
+  task.last_beat = millis();
+  *task.handle = xTaskCreateStaticPinnedToCore(task.function, task.name, task.stack_words, NULL, task.priority, task.stack,
+                                               task.tcb, task.core);
+  esp_task_wdt_add(*task.handle);
+}
+
+void reboot_for(SupervisedTask &task, const char *reason)
+{
+  Serial.printf("Supervisor: %s %s, rebooting\n", task.name, reason);
+  postmortem_record(EVENT_REBOOT, &task - supervised_tasks);
+  Serial.flush();
+  ESP.restart();
+}
+
+// Called every supervisor period while a stop is pending
+void finish_restart(SupervisedTask &task, unsigned long now_ms)
+{
+  if (!task.parked || eTaskGetState(*task.handle) != eSuspended)
+  {
+    if (now_ms - task.stop_requested_ms > TASK_STOP_TIMEOUT_MS)
+      reboot_for(task, "did not reach a safe point to restart");
+    return;
+  }
+
+  // Its TCB and stack are reused below, so it must be off every kernel list
+  // first. A suspended task deleted from another task is released at once;
+  // wait for the kernel to report it deleted rather than assume so.
+  TaskHandle_t old = *task.handle;
+  vTaskDelete(old);
+  unsigned long reap_ms = millis();
+  while (eTaskGetState(old) != eDeleted)
+  {
+    if (millis() - reap_ms > TASK_REAP_TIMEOUT_MS)
+      reboot_for(task, "was not released after deletion");
+    vTaskDelay(1);
+  }
+  task.stop_requested = false;
+  task.unwinding = false;
+  task.parked = false;
+  start_task(task);
+  task.restarts++;
+  postmortem_record(EVENT_TASK_RESTART, &task - supervised_tasks);
+  Serial.printf("Supervisor: %s restarted\n", task.name);
+}
+
+void supervisor_task(void *parameter)
+{
+  esp_task_wdt_add(NULL);
+  for (;;)
+  {
+    esp_task_wdt_reset();
+    postmortem_mark_stable();
+    cpu_usage_sample();
+    // Here rather than on the keep-alive task, which can sit in
+    // WIFI_MQTT_connection() for the whole deadline while the network is down
+    ota_check_verify_deadline();
+    unsigned long now_ms = millis();
+
+    for (SupervisedTask &task : supervised_tasks)
+    {
+      if (task.stop_requested)
+      {
+        finish_restart(task, now_ms);
+        continue;
+      }
+
+      uint32_t overdue = now_ms - task.last_beat;
+      if (overdue <= task.deadline_ms)
+      {
+        task.late = false;
+        task.restarted = false;
+        continue;
+      }
+
+      if (overdue > task.worst_ms)
+        task.worst_ms = overdue;
+
+      if (!task.late)
+      {
+        task.late = true;
+        task.late_state = state;
+        task.violations++;
+        deadline_violations[state].fetch_add(1, std::memory_order_relaxed);
+        postmortem_record(EVENT_TASK_STALL, &task - supervised_tasks);
+        Serial.printf("Supervisor: %s missed its %u ms deadline in state %s\n",
+                      task.name, task.deadline_ms, state_names[state]);
+      }
+
+      if (task.restart_after_ms && !task.restarted && overdue > task.restart_after_ms)
+      {
+        task.restarted = true;
+        task.stop_requested_ms = now_ms;
+        task.unwinding = false;
+        task.stop_requested = true;
+        Serial.printf("Supervisor: asking %s to restart\n", task.name);
+        continue;
+      }
+
+      if (overdue > task.reboot_after_ms)
+        reboot_for(task, "stalled");
+    }
+
+    vTaskDelay(SUPERVISOR_PERIOD_MS / portTICK_PERIOD_MS);
+  }
+}
+
+/*
+   Sensor drivers
+
+   Each sensor is a driver in sensor_drivers that lists the quantities it
+   measures and runs its own conversion cycle. begin() runs once at boot.
+   When a driver is due, the scheduler calls start(), then poll() on every
+   pass until it returns SENSOR_DONE with a record or SENSOR_FAILED. poll()
+   never waits for the sensor, so conversions on different sensors overlap
+   and the UI task that runs the scheduler never blocks on one. Adaptive
+   drivers are due every adaptive sample interval, the others whenever
+   their interval_ms() has passed, counted from the previous start. A
+   conversion still busy after timeout_ms fails.
+
+   register_sensors() gives every driver's quantities a slot in quantities[]
+   in the order of sensor_drivers. The history, the log, the JSON, the
+   metrics and the telemetry all walk that table, and the alert levels come
+   from the quantities too. A new sensor needs only its driver functions,
+   its QuantityInfo list and one line in sensor_drivers. Add new drivers at
+   the end, so the slots of logged quantities keep their meaning.
+*/
+enum SENSOR_POLLS
+{
+  SENSOR_BUSY,
+  SENSOR_DONE,
+  SENSOR_FAILED,
+};
+
+struct SensorDriver
+{
+  const char *name;
+  const QuantityInfo *quantities; // indexed by the record's quantity
+  uint8_t quantity_count;
+  void (*begin)();
+  bool (*start)(); // false if the conversion could not start
+  SENSOR_POLLS (*poll)(SensorRecord &record);
+  bool adaptive;
+  uint32_t (*interval_ms)(); // for the drivers that are not adaptive
+  uint32_t timeout_ms;
+
+  uint8_t first_slot; // of its quantities in quantities[]
+  bool converting;
+  bool started;
+  unsigned long start_ms;
+  uint32_t reads;
+  uint32_t failures;
+};
+
+/*
+   PMS7003, in passive mode: it sends a frame only when asked. Its fan and
+   laser wear out and draw about 100 mA, so while the sensor urgency is
+   below PMS_AWAKE_URGENCY and the SENSOR screen is not shown it sleeps
+   between reads, PMS_SLEEP_INTERVAL_MS apart. A read then wakes it, waits
+   PMS_WARMUP_MS for the airflow to settle, asks for a frame and puts it
+   back to sleep. That runs the fan about half the time and still sees a
+   rising level within a minute, so the urgency, which the next DHT22 sample
+   recomputes from the latest readings, can catch it before the alert level.
+   Otherwise it stays awake and is read every PMS_AWAKE_INTERVAL_MS. The
+   frame bytes are taken as they arrive and checked against the checksum.
+*/
+#define PMS_AWAKE_URGENCY 25
+#define PMS_AWAKE_INTERVAL_MS 1000
+#define PMS_SLEEP_INTERVAL_MS 60000 // start to start, so the warm-up counts
+#define PMS_WARMUP_MS 30000 // the datasheet's time to stable readings after waking
+
+const QuantityInfo PMS_QUANTITIES_INFO[] = {
+    {"pm1", "ug/m3", 75},
+    {"pm2_5", "ug/m3", 75},
+    {"pm10", "ug/m3", 150},
+};
+
+uint8_t pms_frame[PM_FRAME_LENGTH];
+int pms_length = 0;
+bool pms_in_sync = true;
+bool pms_awake = true; // it powers up awake
+bool pms_requested = false;
+unsigned long pms_woke_ms = 0;
+
+void pms_send(uint8_t code, uint16_t data)
+{
+  uint8_t command[PM_COMMAND_LENGTH];
+  pm_command(code, data, command);
+  softwareSerial.write(command, sizeof(command));
+}
+
+bool pms_keep_awake()
+{
+  return sensor_urgency >= PMS_AWAKE_URGENCY || state == SENSOR;
+}
+
+uint32_t pms_interval_ms()
+{
+  return pms_keep_awake() ? PMS_AWAKE_INTERVAL_MS : PMS_SLEEP_INTERVAL_MS;
+}
+
+// Ends a read: back to sleep unless the readings are wanted often
+SENSOR_POLLS pms_finish(SENSOR_POLLS result)
+{
+  if (!pms_keep_awake())
+  {
+    pms_send(PMS_CMD_SLEEP, 0);
+    pms_awake = false;
+  }
+  return result;
+}
+
+void pms_begin()
+{
+  softwareSerial.begin(9600);
+  pms_send(PMS_CMD_MODE, 0);
+}
+
+bool pms_start()
+{
+  // Anything waiting is left from before, such as the answer to a command
+  while (softwareSerial.available())
+    softwareSerial.read();
+  pms_length = 0;
+  pms_requested = false;
+
+  if (!pms_awake)
+  {
+    pms_send(PMS_CMD_SLEEP, 1);
+    pms_awake = true;
+    pms_woke_ms = millis();
+  }
+  return true;
+}
+
+SENSOR_POLLS pms_poll(SensorRecord &record)
+{
+  if (!pms_requested)
+  {
+    if (millis() - pms_woke_ms < PMS_WARMUP_MS)
+      return SENSOR_BUSY;
+    pms_send(PMS_CMD_READ, 0);
+    pms_requested = true;
+  }
+
+  while (softwareSerial.available())
+  {
+    uint8_t byte = softwareSerial.read();
+    if ((pms_length == 0 && byte != 0x42) || (pms_length == 1 && byte != 0x4d))
+    {
+      // Count each run of bytes outside a frame once
+      if (pms_in_sync)
+      {
+        Serial.println("Cannot find the data header.");
+        count_metric(COUNTER_PM_HEADER_ERRORS);
+        postmortem_record(EVENT_SENSOR_ERROR, COUNTER_PM_HEADER_ERRORS);
+      }
+      pms_in_sync = false;
+      pms_length = byte == 0x42 ? 1 : 0;
+      continue;
+    }
+
+    pms_frame[pms_length++] = byte;
+    if (pms_length < PM_FRAME_LENGTH)
+      continue;
+
+    pms_length = 0;
+    pms_in_sync = true;
+    if (!pm_frame_checksum_ok(pms_frame))
+    {
+      count_metric(COUNTER_PM_HEADER_ERRORS);
+      return pms_finish(SENSOR_FAILED);
+    }
+    parse_pm_frame(pms_frame, PM_FRAME_LENGTH, record);
+    return pms_finish(SENSOR_DONE);
+  }
+  return SENSOR_BUSY;
+}
+
+/*
+   DHT22, read through the RMT peripheral. start() pulls the line low, and
+   an esp_timer releases it DHT_START_US later and starts the RMT receiver.
+   The receiver times every pulse of the answer by itself and hands them
+   over once the line has been idle for DHT_IDLE_US, so poll() only has to
+   check for that and decode them. The line is open drain with a pull-up,
+   driven through the GPIO while RMT listens on the same pin.
+*/
+#define DHT_RMT_CHANNEL RMT_CHANNEL_4
+#define DHT_START_US 1100 // the sensor needs at least 1 ms low to wake up
+#define DHT_IDLE_US 200   // longer than any pulse, so the answer has ended
+#define DHT_MAX_PULSES 48 // the release and the response, the 40 bits and spares
+
+const QuantityInfo DHT_QUANTITIES_INFO[] = {
+    {"humidity", "%", 70},
+    {"temperature", "C", 35},
+};
+
+RingbufHandle_t dht_ringbuf = NULL;
+esp_timer_handle_t dht_release_timer = NULL;
+
+void dht_release(void *)
+{
+  rmt_rx_start(DHT_RMT_CHANNEL, true);
+  gpio_set_level((gpio_num_t)DHT_PIN, 1);
+}
+
+void dht_begin()
+{
+  rmt_config_t config = RMT_DEFAULT_CONFIG_RX((gpio_num_t)DHT_PIN, DHT_RMT_CHANNEL);
+  config.clk_div = 80; // 1 us ticks
+  config.rx_config.filter_en = true;
+  config.rx_config.filter_ticks_thresh = 100; // APB cycles, glitches under 1.25 us
+  config.rx_config.idle_threshold = DHT_IDLE_US;
+  rmt_config(&config);
+  rmt_driver_install(DHT_RMT_CHANNEL, 512, 0);
+  rmt_get_ringbuf_handle(DHT_RMT_CHANNEL, &dht_ringbuf);
+
+  // rmt_config() made the pin an input; keep the input for RMT and add the driver
+  gpio_set_direction((gpio_num_t)DHT_PIN, GPIO_MODE_INPUT_OUTPUT_OD);
+  gpio_set_pull_mode((gpio_num_t)DHT_PIN, GPIO_PULLUP_ONLY);
+  gpio_set_level((gpio_num_t)DHT_PIN, 1);
+
+  esp_timer_create_args_t timer = {};
+  timer.callback = dht_release;
+  timer.name = "dht_release";
+  esp_timer_create(&timer, &dht_release_timer);
+}
+
+bool dht_start()
+{
+  if (!dht_ringbuf || !dht_release_timer)
+    return false;
+
+  // Drop whatever noise the receiver caught since the last read
+  rmt_rx_stop(DHT_RMT_CHANNEL);
+  size_t size;
+  void *items;
+  while ((items = xRingbufferReceive(dht_ringbuf, &size, 0)))
+    vRingbufferReturnItem(dht_ringbuf, items);
+
+  gpio_set_level((gpio_num_t)DHT_PIN, 0);
+  return esp_timer_start_once(dht_release_timer, DHT_START_US) == ESP_OK;
+}
+
+SENSOR_POLLS dht_poll(SensorRecord &record)
+{
+  size_t size;
+  rmt_item32_t *items = (rmt_item32_t *)xRingbufferReceive(dht_ringbuf, &size, 0);
+  if (!items)
+    return SENSOR_BUSY;
+
+  uint16_t high_us[DHT_MAX_PULSES];
+  int count = 0;
+  for (size_t i = 0; i < size / sizeof(rmt_item32_t) && count < DHT_MAX_PULSES; i++)
+  {
+    if (items[i].level0 && items[i].duration0)
+      high_us[count++] = items[i].duration0;
+    if (items[i].level1 && items[i].duration1 && count < DHT_MAX_PULSES)
+      high_us[count++] = items[i].duration1;
+  }
+  vRingbufferReturnItem(dht_ringbuf, items);
+  rmt_rx_stop(DHT_RMT_CHANNEL);
+
+  if (!dht22_decode(high_us, count, record))
+  {
+    count_metric(COUNTER_DHT_FAILURES);
+    postmortem_record(EVENT_SENSOR_ERROR, COUNTER_DHT_FAILURES);
+    return SENSOR_FAILED;
+  }
+  return SENSOR_DONE;
+}
+
+#define DRIVER_QUANTITIES(list) list, sizeof(list) / sizeof(list[0])
+
+SensorDriver sensor_drivers[] = {
+    {"dht22", DRIVER_QUANTITIES(DHT_QUANTITIES_INFO), dht_begin, dht_start, dht_poll, true, NULL, 500},
+    {"pms7003", DRIVER_QUANTITIES(PMS_QUANTITIES_INFO), pms_begin, pms_start, pms_poll, false, pms_interval_ms, PMS_WARMUP_MS + 3000},
+};
+
+// Latest reading of a quantity by name. False before the first reading or
+// if no driver measures it.
+bool quantity_reading(const char *name, int &value)
+{
+  for (int i = 0; i < quantity_count; i++)
+  {
+    if (!strcmp(quantities[i].info->name, name))
+    {
+      value = quantities[i].value;
+      return value != SENSOR_MISSING;
+    }
+  }
+  return false;
+}
+
+// As quantity_reading(), with 0 for no reading, for the displays
+int quantity_value(const char *name)
+{
+  int value;
+  return quantity_reading(name, value) ? value : 0;
+}
+
+void register_sensors()
+{
+  for (SensorDriver &driver : sensor_drivers)
+  {
+    if (quantity_count + driver.quantity_count > SENSOR_MAX_QUANTITIES)
+    {
+      Serial.printf("Sensors: no room for the quantities of %s, raise SENSOR_MAX_QUANTITIES\n", driver.name);
+      driver.quantity_count = 0;
+    }
+    driver.first_slot = quantity_count;
+    for (int i = 0; i < driver.quantity_count; i++)
+      quantities[quantity_count++] = {&driver.quantities[i], SENSOR_MISSING};
+  }
+}
+
+void apply_sensor_record(const SensorDriver &driver, const SensorRecord &record)
+{
+  for (int i = 0; i < record.count; i++)
+  {
+    uint8_t quantity = record.readings[i].quantity;
+    if (quantity >= driver.quantity_count)
+      continue;
+    quantities[driver.first_slot + quantity].value = record.readings[i].value;
+    air_quality_reading(driver.quantities[quantity].name, record.readings[i].value);
+  }
+}
+
+void start_sensors()
+{
+  register_sensors();
+  for (SensorDriver &driver : sensor_drivers)
+    driver.begin();
+}
+
+// Runs one pass of every driver's conversion cycle. Returns true if an
+// adaptive driver finished a read.
+bool poll_sensors(uint32_t adaptive_interval_ms)
+{
+  unsigned long now_ms = millis();
+  bool adaptive_read = false;
+
+  for (int i = 0; i < sizeof(sensor_drivers) / sizeof(sensor_drivers[0]); i++)
+  {
+    SensorDriver &driver = sensor_drivers[i];
+    if (!driver.converting)
+    {
+      uint32_t interval_ms = driver.adaptive ? adaptive_interval_ms : driver.interval_ms();
+      if (driver.started && now_ms - driver.start_ms < interval_ms)
+        continue;
+      driver.started = true;
+      driver.start_ms = now_ms;
+      if (!driver.start())
+      {
+        driver.failures++;
+        continue;
+      }
+      driver.converting = true;
+    }
+
+    SensorRecord record = {(uint32_t)now_ms, (uint8_t)i, 0};
+    SENSOR_POLLS result = driver.poll(record);
+    if (result == SENSOR_BUSY && now_ms - driver.start_ms < driver.timeout_ms)
+      continue;
+
+    driver.converting = false;
+    if (result == SENSOR_DONE)
+    {
+      driver.reads++;
+      apply_sensor_record(driver, record);
+#ifdef SERIAL_TELEMETRY
+      telemetry_sensors(i);
+#endif
+      adaptive_read |= driver.adaptive;
+    }
+    else
+    {
+      driver.failures++; // failed or timed out
+    }
+  }
+  return adaptive_read;
+}
+
+/*
+   Adaptive sampling
+
+   Each reading gets an urgency from 0 to 100: how close it is to its alert
+   level or how fast it moves (a step of a tenth of the level per sample is
+   100). Closeness only counts in the last URGENCY_RAMP_PERCENT below the
+   level, from 0 there to 100 at the level, so ordinary readings leave the
+   clock at its slowest rates. The highest urgency sets both the DHT sample
+   interval and the publish interval between their limits, and keeps the
+   PMS7003 awake.
+*/
+int reading_urgency(int value, int previous, int alert)
+{
+  int ramp = alert * URGENCY_RAMP_PERCENT / 100;
+  int near = (value - (alert - ramp)) * 100 / max(ramp, 1);
+  int change = abs(value - previous) * 100 / max(alert / 10, 1);
+  return constrain(max(near, change), 0, 100);
+}
+
+// The reading and alert level of quantity i, with the AQI after the last
+// quantity. False if it has no alert level or no reading yet.
+bool alert_reading(int i, int &value, int &alert)
+{
+  if (i == quantity_count)
+  {
+    value = sensor_aqi; // -1 until it has data
+    alert = AQI_ALERT;
+    return value >= 0;
+  }
+  value = quantities[i].value;
+  alert = quantities[i].info->alert;
+  return alert > 0 && value != SENSOR_MISSING;
+}
+
+void update_sensor_urgency()
+{
+  static int previous[SENSOR_MAX_QUANTITIES + 1];
+  static bool seen[SENSOR_MAX_QUANTITIES + 1];
+
+  int urgency = 0;
+  for (int i = 0; i <= quantity_count; i++)
+  {
+    int value, alert;
+    if (!alert_reading(i, value, alert))
+      continue;
+    urgency = max(urgency, reading_urgency(value, seen[i] ? previous[i] : value, alert));
+    previous[i] = value;
+    seen[i] = true;
+  }
+
+  sensor_urgency = max(urgency, sensor_urgency - URGENCY_DECAY);
+  sample_interval_ms = SAMPLE_MAX_MS - (SAMPLE_MAX_MS - SAMPLE_MIN_MS) * sensor_urgency / 100;
+  publish_effective_s = publish_interval_s - (publish_interval_s - publish_min_interval_s) * sensor_urgency / 100;
+}
+
+// Only the adaptive drivers and the urgency follow the sample interval. The
+// SENSOR screen always samples at the fastest rate.
+void sample_sensors(bool watching)
+{
+  if (poll_sensors(watching ? SAMPLE_MIN_MS : sample_interval_ms))
+  {
+    update_sensor_urgency();
+  }
+  update_air_quality();
+}
+
+bool sensor_alert()
+{
+  for (int i = 0; i <= quantity_count; i++)
+  {
+    int value, alert;
+    if (alert_reading(i, value, alert) && value >= alert)
+      return true;
+  }
+  return false;
+}
+
+/*
+   Air quality index
+
+   US EPA AQI from the PM2.5 and PM10 NowCast, in integer math. Concentrations
+   are kept in tenths of a ug/m3. Each fresh PM reading from the sensor is
+   added to the open hourly bucket, and the NowCast is a fixed 12-step pass
+   over the last 11 hourly averages with the open hour as the most recent
+   one. The hours also roll over without readings, so an hour the sensor
+   missed stays empty and the NowCast lapses once two of the last three are.
+*/
+#define NOWCAST_HOURS 12
+#define AQI_ROLL_MS 1000
+
+struct AqiBreakpoint
+{
+  int16_t c_lo, c_hi; // tenths of a ug/m3
+  int16_t i_lo, i_hi;
+};
+
+// 2024 PM2.5 breakpoints
+constexpr AqiBreakpoint PM2_5_BREAKPOINTS[] = {
+    {0, 90, 0, 50},
+    {91, 354, 51, 100},
+    {355, 554, 101, 150},
+    {555, 1254, 151, 200},
+    {1255, 2254, 201, 300},
+    {2255, 3254, 301, 500},
+};
+
+constexpr AqiBreakpoint PM10_BREAKPOINTS[] = {
+    {0, 540, 0, 50},
+    {550, 1540, 51, 100},
+    {1550, 2540, 101, 150},
+    {2550, 3540, 151, 200},
+    {3550, 4240, 201, 300},
+    {4250, 6040, 301, 500},
+};
+
+constexpr int BREAKPOINT_COUNT = sizeof(PM2_5_BREAKPOINTS) / sizeof(PM2_5_BREAKPOINTS[0]);
+
+// The short names fit the LCD next to the index
+const char *const aqi_categories[][2] = {
+    {"Good", "Good"},
+    {"Moderate", "Moderate"},
+    {"USG", "Unhealthy for Sensitive Groups"},
+    {"Unhealthy", "Unhealthy"},
+    {"V.Unhlthy", "Very Unhealthy"},
+    {"Hazardous", "Hazardous"},
+};
+
+struct NowCast
+{
+  uint32_t hour; // now() / 3600 of the open bucket
+  uint32_t sum;  // ug/m3
+  uint32_t count;
+  int16_t hourly[NOWCAST_HOURS]; // tenths, [0] is the last full hour, -1 = no data
+  int concentration;             // tenths, -1 = not enough data
+};
+
+NowCast nowcast_pm2_5 = {0, 0, 0, {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}, -1};
+NowCast nowcast_pm10 = {0, 0, 0, {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}, -1};
+int aqi_pm2_5 = -1, aqi_pm10 = -1;
+
+void nowcast_update(NowCast &nc)
+{
+  int16_t c[NOWCAST_HOURS];
+  c[0] = nc.count ? nc.sum * 10 / nc.count : -1;
+  for (int i = 1; i < NOWCAST_HOURS; i++)
+    c[i] = nc.hourly[i - 1];
+
+  // Two of the three most recent hours must have data
+  if ((c[0] >= 0) + (c[1] >= 0) + (c[2] >= 0) < 2)
+  {
+    nc.concentration = -1;
+    return;
+  }
+
+  int lo = INT16_MAX, hi = 0;
+  for (int i = 0; i < NOWCAST_HOURS; i++)
+  {
+    if (c[i] < 0)
+      continue;
+    lo = min(lo, (int)c[i]);
+    hi = max(hi, (int)c[i]);
+  }
+
+  // Weight factor in 1/1024ths, never below one half
+  uint32_t w = hi ? max(lo * 1024 / hi, 512) : 1024;
+  uint32_t weight = 1024, num = 0, den = 0;
+  for (int i = 0; i < NOWCAST_HOURS; i++)
+  {
+    if (c[i] >= 0)
+    {
+      num += weight * c[i];
+      den += weight;
+    }
+    weight = weight * w / 1024;
+  }
+  nc.concentration = num / den;
+}
+
+// Makes hour the open bucket, closing the ones before it
+void nowcast_roll(NowCast &nc, uint32_t hour)
+{
+  if (hour < nc.hour) // clock set back
+  {
+    nc = {hour, 0, 0, {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}, -1};
+  }
+  else if (hour > nc.hour)
+  {
+    uint32_t elapsed = min(hour - nc.hour, (uint32_t)NOWCAST_HOURS);
+    int16_t closed = nc.count ? nc.sum * 10 / nc.count : -1;
+    memmove(nc.hourly + elapsed, nc.hourly, (NOWCAST_HOURS - elapsed) * sizeof(nc.hourly[0]));
+    for (uint32_t i = 0; i < elapsed; i++)
+      nc.hourly[i] = -1;
+    nc.hourly[elapsed - 1] = closed;
+    nc.hour = hour;
+    nc.sum = 0;
+    nc.count = 0;
+  }
+}
+
+void nowcast_add(NowCast &nc, int ugm3, uint32_t hour)
+{
+  nowcast_roll(nc, hour);
+  nc.sum += ugm3;
+  nc.count++;
+  nowcast_update(nc);
+}
+
+int aqi_from_concentration(int tenths, const AqiBreakpoint *table)
+{
+  if (tenths < 0)
+    return -1;
+
+  for (int i = 0; i < BREAKPOINT_COUNT; i++)
+  {
+    const AqiBreakpoint &b = table[i];
+    if (tenths <= b.c_hi)
+    {
+      tenths = max(tenths, (int)b.c_lo); // falls between two truncated ranges
+      return b.i_lo + ((b.i_hi - b.i_lo) * (tenths - b.c_lo) + (b.c_hi - b.c_lo) / 2) / (b.c_hi - b.c_lo);
+    }
+  }
+  return 500;
+}
+
+int aqi_category(int aqi)
+{
+  if (aqi <= 50)
+    return 0;
+  if (aqi <= 100)
+    return 1;
+  if (aqi <= 150)
+    return 2;
+  if (aqi <= 200)
+    return 3;
+  if (aqi <= 300)
+    return 4;
+  return 5;
+}
+
+void update_aqi()
+{
+  // PM2.5 is truncated to 0.1 ug/m3 and PM10 to 1 ug/m3
+  aqi_pm2_5 = aqi_from_concentration(nowcast_pm2_5.concentration, PM2_5_BREAKPOINTS);
+  aqi_pm10 = aqi_from_concentration(nowcast_pm10.concentration < 0 ? -1 : nowcast_pm10.concentration / 10 * 10, PM10_BREAKPOINTS);
+  sensor_aqi = max(aqi_pm2_5, aqi_pm10);
+}
+
+// Called with every fresh reading a sensor driver returns
+void air_quality_reading(const char *name, int value)
+{
+  if (!strcmp(name, "pm2_5"))
+    nowcast_add(nowcast_pm2_5, value, clock_now() / 3600);
+  else if (!strcmp(name, "pm10"))
+    nowcast_add(nowcast_pm10, value, clock_now() / 3600);
+  else
+    return;
+  update_aqi();
+}
+
+// Closes the hours that passed without readings
+void update_air_quality()
+{
+  static unsigned long last_roll_ms = 0;
+  if (millis() - last_roll_ms < AQI_ROLL_MS)
+    return;
+  last_roll_ms = millis();
+
+  uint32_t hour = clock_now() / 3600;
+  if (hour == nowcast_pm2_5.hour && hour == nowcast_pm10.hour)
+    return;
+  nowcast_roll(nowcast_pm2_5, hour);
+  nowcast_roll(nowcast_pm10, hour);
+  nowcast_update(nowcast_pm2_5);
+  nowcast_update(nowcast_pm10);
+  update_aqi();
+}
+
+/*
+   Sensor log
+
+   The one-minute history samples are also kept on the LittleFS partition,
+   so a network outage or a reboot leaves no gap. Files are segments of at
+   most LOG_SEGMENT_RECORDS fixed-size records in time order, each record
+   with its own CRC. A segment is only ever appended to and, once old,
+   deleted. Samples are buffered and appended LOG_FLUSH_RECORDS at a time,
+   so the file system commits once per batch instead of once per sample;
+   the buffer is lost on a reset.
+
+   Raw segments (/log/r<n>) hold the samples. Past LOG_RAW_SEGMENTS the
+   oldest is compacted into hourly aggregates, the mean and max of every
+   reading, which go to the aggregate segments (/log/a<n>), and is deleted;
+   an hour split across two raw segments gives two aggregates.
+   Aggregate segments past LOG_AGGREGATE_SEGMENTS are dropped. That is about
+   two days of minutes and a year of hours in under 500 KB.
+
+   Records hold a value per quantity slot, as registered by the sensor
+   drivers, with SENSOR_MISSING where a sensor had no reading; aggregates
+   average only the readings present. Segments written with another record
+   layout are deleted at boot.
+
+   log_query_begin() and log_query_next() stream the records with a time in
+   [from, to): aggregates, then raw records, then the unflushed buffer.
+   Whole segments are skipped from the index and the start of each segment
+   is found by binary search. Each log_query_next() copies a batch under the
+   lock and resumes after the time of the last record it returned, so the
+   caller sends with the log unlocked and log_add() never waits on a slow
+   client. The log only moves forward in time; samples
+   older than the last one logged, after the clock was set back, are dropped.
+*/
+#define LOG_DIR "/log"
+#define LOG_MAGIC 0x32474c53 // "SLG2"
+#define LOG_SEGMENT_RECORDS 256
+#define LOG_FLUSH_RECORDS 15
+#define LOG_RAW_SEGMENTS 12
+#define LOG_AGGREGATE_SEGMENTS 36
+#define LOG_INDEX_SIZE 40 // more than either level holds
+#define LOG_AGGREGATE_S 3600
+#define LOG_MIN_TIME 1577836800 // 2020-01-01, anything earlier means the clock is not set
+#define LOG_VALUES SENSOR_MAX_QUANTITIES
+#define LOG_LOCK_MS 10000
+#define LOG_QUERY_BATCH 16
+
+// Oldest data first, the order queries read them in
+enum LOG_LEVELS
+{
+  LOG_AGGREGATE,
+  LOG_RAW,
+  LOG_LEVEL_COUNT,
+};
+
+struct LogRecord
+{
+  uint32_t time;    // UTC, the start of the hour for aggregates
+  uint16_t samples; // 1 for raw records
+  int16_t mean[LOG_VALUES];
+  int16_t max[LOG_VALUES];
+  uint16_t crc; // over everything before it
+};
+
+struct LogSegmentHeader
+{
+  uint32_t magic;
+  uint32_t first_time;
+  uint16_t record_size;
+  uint8_t level;
+  uint8_t reserved;
+};
+
+struct LogLevel
+{
+  char prefix;
+  uint32_t max_segments;
+  uint32_t first_seq;      // oldest segment on flash
+  uint32_t next_seq;       // one past the newest
+  uint32_t active_records; // in the newest segment
+  uint32_t first_times[LOG_INDEX_SIZE]; // by seq % LOG_INDEX_SIZE
+};
+
+struct LogStats
+{
+  uint32_t appends;
+  uint32_t dropped;
+  uint32_t write_errors;
+  uint32_t corrupt_records; // skipped by reads, once per read that meets them
+  uint32_t compactions;
+  uint64_t bytes_written; // file contents, not counting LittleFS metadata
+  uint32_t queries;
+  uint32_t last_query_ms;
+};
+
+struct LogQuery
+{
+  uint32_t from, to; // from moves past every batch returned
+  int level;         // LOG_LEVEL_COUNT means the unflushed buffer
+  uint32_t seq;
+  File file; // only open while a batch is read
+  uint32_t busy_us;
+  bool done;
+};
+
+LogLevel log_levels[LOG_LEVEL_COUNT] = {
+    {'a', LOG_AGGREGATE_SEGMENTS},
+    {'r', LOG_RAW_SEGMENTS},
+};
+LogRecord log_buffer[LOG_FLUSH_RECORDS];
+int log_buffered = 0;
+uint32_t log_last_time = 0;
+bool log_ready = false;
+LogStats log_stats;
+
+void log_path(char *path, int level, uint32_t seq)
+{
+  sprintf(path, LOG_DIR "/%c%u", log_levels[level].prefix, seq);
+}
+
+uint16_t log_record_crc(const LogRecord &record)
+{
+  return crc16_ccitt((const uint8_t *)&record, offsetof(LogRecord, crc));
+}
+
+// Reads the next record with a good CRC. A corrupt record is skipped, not
+// taken for the end of the segment, so one bad write loses one record.
+// Returns false at the end of the file.
+bool log_read(File &file, LogRecord &record)
+{
+  while (file.read((uint8_t *)&record, sizeof(record)) == sizeof(record))
+  {
+    if (record.crc == log_record_crc(record))
+      return true;
+    log_stats.corrupt_records++;
+  }
+  return false;
+}
+
+// Positions the file at its first record with a time of at least from
+void log_seek(File &file, uint32_t from)
+{
+  uint32_t size = file.size();
+  uint32_t lo = 0, hi = size > sizeof(LogSegmentHeader) ? (size - sizeof(LogSegmentHeader)) / sizeof(LogRecord) : 0;
+  LogRecord record;
+  while (lo < hi)
+  {
+    uint32_t mid = (lo + hi) / 2;
+    file.seek(sizeof(LogSegmentHeader) + mid * sizeof(LogRecord));
+    if (log_read(file, record) && record.time < from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  file.seek(sizeof(LogSegmentHeader) + lo * sizeof(LogRecord));
+}
+
+// Appends records to the newest segment of a level, starting new segments
+// as they fill
+bool log_append(int level, const LogRecord *records, int count)
+{
+  LogLevel &l = log_levels[level];
+  char path[24];
+
+  while (count > 0)
+  {
+    bool fresh = l.next_seq == l.first_seq || l.active_records >= LOG_SEGMENT_RECORDS;
+    uint32_t seq = fresh ? l.next_seq : l.next_seq - 1;
+    log_path(path, level, seq);
+    File file = LittleFS.open(path, fresh ? "w" : "a");
+    if (!file)
+      return false;
+
+    size_t bytes = 0;
+    if (fresh)
+    {
+      LogSegmentHeader header = {LOG_MAGIC, records[0].time, sizeof(LogRecord), (uint8_t)level, 0};
+      bytes += file.write((const uint8_t *)&header, sizeof(header));
+    }
+    int n = min(count, (int)(LOG_SEGMENT_RECORDS - (fresh ? 0 : l.active_records)));
+    bytes += file.write((const uint8_t *)records, n * sizeof(LogRecord));
+    file.close();
+    log_stats.bytes_written += bytes;
+    if (bytes != n * sizeof(LogRecord) + (fresh ? sizeof(LogSegmentHeader) : 0))
+      return false;
+
+    if (fresh)
+    {
+      l.first_times[seq % LOG_INDEX_SIZE] = records[0].time;
+      l.next_seq++;
+      l.active_records = 0;
+    }
+    l.active_records += n;
+    records += n;
+    count -= n;
+  }
+  return true;
+}
+
+void log_finish_aggregate(LogRecord &aggregate, const int32_t *sums, const uint32_t *counts)
+{
+  for (int v = 0; v < LOG_VALUES; v++)
+    aggregate.mean[v] = counts[v] ? sums[v] / (int32_t)counts[v] : SENSOR_MISSING;
+  aggregate.crc = log_record_crc(aggregate);
+}
+
+// Folds the oldest raw segment into hourly aggregates and deletes it
+void log_compact_oldest()
+{
+  LogLevel &raw = log_levels[LOG_RAW];
+  char path[24];
+  log_path(path, LOG_RAW, raw.first_seq);
+
+  File file = LittleFS.open(path, "r");
+  if (file)
+  {
+    LogRecord aggregates[LOG_FLUSH_RECORDS];
+    int32_t sums[LOG_VALUES];
+    uint32_t counts[LOG_VALUES];
+    int n = 0;
+    LogRecord record;
+
+    file.seek(sizeof(LogSegmentHeader));
+    while (log_read(file, record))
+    {
+      uint32_t hour = record.time - record.time % LOG_AGGREGATE_S;
+      if (n == 0 || aggregates[n - 1].time != hour)
+      {
+        if (n > 0)
+          log_finish_aggregate(aggregates[n - 1], sums, counts);
+        if (n == LOG_FLUSH_RECORDS)
+        {
+          if (!log_append(LOG_AGGREGATE, aggregates, n))
+            log_stats.write_errors++;
+          n = 0;
+        }
+        aggregates[n] = {hour, 0};
+        for (int v = 0; v < LOG_VALUES; v++)
+        {
+          sums[v] = 0;
+          counts[v] = 0;
+          aggregates[n].max[v] = SENSOR_MISSING; // below any reading
+        }
+        n++;
+      }
+
+      LogRecord &aggregate = aggregates[n - 1];
+      aggregate.samples += record.samples;
+      for (int v = 0; v < LOG_VALUES; v++)
+      {
+        if (record.mean[v] == SENSOR_MISSING)
+          continue;
+        sums[v] += record.mean[v] * record.samples;
+        counts[v] += record.samples;
+        aggregate.max[v] = max(aggregate.max[v], record.max[v]);
+      }
+    }
+    file.close();
+
+    if (n > 0)
+    {
+      log_finish_aggregate(aggregates[n - 1], sums, counts);
+      if (!log_append(LOG_AGGREGATE, aggregates, n))
+        log_stats.write_errors++;
+    }
+  }
+
+  LittleFS.remove(path);
+  raw.first_seq++;
+  log_stats.compactions++;
+}
+
+void log_drop_oldest(int level)
+{
+  char path[24];
+  log_path(path, level, log_levels[level].first_seq++);
+  LittleFS.remove(path);
+}
+
+void log_flush()
+{
+  if (log_buffered == 0)
+    return;
+  if (!log_append(LOG_RAW, log_buffer, log_buffered))
+    log_stats.write_errors++;
+  log_buffered = 0;
+
+  while (log_levels[LOG_RAW].next_seq - log_levels[LOG_RAW].first_seq > LOG_RAW_SEGMENTS)
+    log_compact_oldest();
+  while (log_levels[LOG_AGGREGATE].next_seq - log_levels[LOG_AGGREGATE].first_seq > LOG_AGGREGATE_SEGMENTS)
+    log_drop_oldest(LOG_AGGREGATE);
+}
+
+void log_add(const SensorSample &sample)
+{
+  if (sample.time < LOG_MIN_TIME || sample.time <= log_last_time ||
+      xSemaphoreTake(log_mutex, pdMS_TO_TICKS(LOG_LOCK_MS)) != pdTRUE)
+  {
+    log_stats.dropped++;
+    return;
+  }
+
+  LogRecord &record = log_buffer[log_buffered++];
+  record = {sample.time, 1};
+  memcpy(record.mean, sample.values, sizeof(record.mean));
+  memcpy(record.max, record.mean, sizeof(record.max));
+  record.crc = log_record_crc(record);
+  log_last_time = sample.time;
+  log_stats.appends++;
+
+  if (log_buffered == LOG_FLUSH_RECORDS)
+    log_flush();
+  xSemaphoreGive(log_mutex);
+}
+
+// Rebuilds the segment index from the file names and headers
+bool log_begin()
+{
+  if (!LittleFS.begin(true))
+  {
+    Serial.println("Log: cannot mount LittleFS");
+    return false;
+  }
+  LittleFS.mkdir(LOG_DIR);
+
+  bool found[LOG_LEVEL_COUNT] = {false, false};
+  int stale = 0;
+  char path[24];
+  File dir = LittleFS.open(LOG_DIR);
+  for (File entry = dir.openNextFile(); entry; entry = dir.openNextFile())
+  {
+    const char *name = strrchr(entry.name(), '/');
+    name = name ? name + 1 : entry.name();
+
+    // Drop segments from firmware with another record layout
+    LogSegmentHeader header = {0};
+    entry.read((uint8_t *)&header, sizeof(header));
+    if (header.magic != LOG_MAGIC || header.record_size != sizeof(LogRecord))
+    {
+      snprintf(path, sizeof(path), LOG_DIR "/%s", name);
+      entry.close();
+      LittleFS.remove(path);
+      stale++;
+      continue;
+    }
+    for (int level = 0; level < LOG_LEVEL_COUNT; level++)
+    {
+      LogLevel &l = log_levels[level];
+      if (name[0] != l.prefix)
+        continue;
+      uint32_t seq = strtoul(name + 1, NULL, 10);
+      if (!found[level] || seq < l.first_seq)
+        l.first_seq = seq;
+      if (!found[level] || seq >= l.next_seq)
+        l.next_seq = seq + 1;
+      found[level] = true;
+    }
+  }
+
+  if (stale)
+    Serial.printf("Log: removed %d segments with an old record layout\n", stale);
+
+  for (int level = 0; level < LOG_LEVEL_COUNT; level++)
+  {
+    LogLevel &l = log_levels[level];
+    for (uint32_t seq = l.first_seq; seq < l.next_seq; seq++)
+    {
+      log_path(path, level, seq);
+      File file = LittleFS.open(path, "r");
+      LogSegmentHeader header = {0};
+      if (file)
+        file.read((uint8_t *)&header, sizeof(header));
+      l.first_times[seq % LOG_INDEX_SIZE] = header.magic == LOG_MAGIC ? header.first_time : 0;
+
+      if (seq + 1 == l.next_seq && file)
+      {
+        // A torn last record leaves a partial one; start a new segment after it
+        uint32_t size = file.size();
+        uint32_t body = size > sizeof(header) ? size - sizeof(header) : 0;
+        l.active_records = body % sizeof(LogRecord) || size < sizeof(header) ? LOG_SEGMENT_RECORDS : body / sizeof(LogRecord);
+
+        LogRecord record;
+        if (level == LOG_RAW && body >= sizeof(LogRecord))
+        {
+          file.seek(sizeof(header) + (body / sizeof(LogRecord) - 1) * sizeof(LogRecord));
+          if (log_read(file, record))
+            log_last_time = record.time;
+        }
+      }
+      file.close();
+    }
+  }
+
+  Serial.printf("Log: %u raw and %u aggregate segments, last sample at %u\n",
+                log_levels[LOG_RAW].next_seq - log_levels[LOG_RAW].first_seq,
+                log_levels[LOG_AGGREGATE].next_seq - log_levels[LOG_AGGREGATE].first_seq, log_last_time);
+  return true;
+}
+
+void log_query_begin(LogQuery &q, uint32_t from, uint32_t to)
+{
+  q.from = from;
+  q.to = to;
+  q.level = 0;
+  q.seq = 0;
+  q.busy_us = 0;
+  q.done = !log_ready;
+}
+
+// Opens the next segment that can hold records in range
+bool log_query_open(LogQuery &q)
+{
+  char path[24];
+  while (q.level < LOG_LEVEL_COUNT)
+  {
+    LogLevel &l = log_levels[q.level];
+    if (q.seq < l.first_seq)
+      q.seq = l.first_seq;
+    // A segment ends before from if the one after it starts no later than from
+    while (q.seq + 1 < l.next_seq && l.first_times[(q.seq + 1) % LOG_INDEX_SIZE] <= q.from)
+      q.seq++;
+
+    if (q.seq >= l.next_seq || l.first_times[q.seq % LOG_INDEX_SIZE] >= q.to)
+    {
+      q.level++;
+      q.seq = 0;
+      continue;
+    }
+
+    log_path(path, q.level, q.seq);
+    q.file = LittleFS.open(path, "r");
+    if (q.file)
+    {
+      log_seek(q.file, q.from);
+      return true;
+    }
+    q.seq++;
+  }
+  return false;
+}
+
+// Copies up to max records in range, oldest first, and returns how many;
+// 0 once the range is done. The log is locked only while they are read.
+int log_query_next(LogQuery &q, LogRecord *records, int max)
+{
+  if (q.done || xSemaphoreTake(log_mutex, pdMS_TO_TICKS(LOG_LOCK_MS)) != pdTRUE)
+    return 0;
+
+  unsigned long start = micros();
+  int n = 0;
+  // Segments may have been added or compacted since the last batch, and the
+  // buffer flushed, so the index is searched again from q.from
+  if (q.level == LOG_LEVEL_COUNT)
+    q.level = LOG_RAW;
+  q.seq = 0;
+  while (n < max && q.level < LOG_LEVEL_COUNT)
+  {
+    if (!q.file && !log_query_open(q))
+      break;
+
+    LogRecord &record = records[n];
+    if (!log_read(q.file, record))
+    {
+      q.file.close();
+      q.file = File();
+      q.seq++;
+    }
+    else if (record.time >= q.to)
+    {
+      q.file.close();
+      q.file = File();
+      q.level++;
+      q.seq = 0;
+    }
+    else if (record.time >= q.from)
+    {
+      n++;
+    }
+  }
+  if (q.file)
+  {
+    q.file.close();
+    q.file = File();
+  }
+
+  // Then whatever has not reached flash yet
+  for (int i = 0; n < max && q.level == LOG_LEVEL_COUNT && i < log_buffered; i++)
+  {
+    if (log_buffer[i].time >= q.from && log_buffer[i].time < q.to)
+      records[n++] = log_buffer[i];
+  }
+  xSemaphoreGive(log_mutex);
+
+  // Times only grow, so the next batch starts after this one
+  if (n > 0)
+    q.from = records[n - 1].time + 1;
+  q.done = n == 0 || q.from == 0;
+  q.busy_us += micros() - start;
+  return n;
+}
+
+void log_query_end(LogQuery &q)
+{
+  if (q.file)
+    q.file.close();
+
+  log_stats.queries++;
+  log_stats.last_query_ms = q.busy_us / 1000;
+  observe_metric(HISTOGRAM_LOG_QUERY_MS, log_stats.last_query_ms);
+}
+
+uint32_t log_bytes_per_day()
+{
+  uint32_t uptime_s = millis() / 1000;
+  return uptime_s ? log_stats.bytes_written * 86400 / uptime_s : 0;
+}
+
+void print_log_stats()
+{
+  static uint32_t last_appends = 0;
+  static unsigned long last_ms = 0;
+
+  unsigned long now_ms = millis();
+  float appends_per_s = now_ms > last_ms ? (log_stats.appends - last_appends) * 1000.0f / (now_ms - last_ms) : 0;
+  last_appends = log_stats.appends;
+  last_ms = now_ms;
+
+  Serial.printf("Log: %.3f appends/s, %u bytes/day, %u compactions, last query %u ms, %u dropped, %u write errors, %u corrupt records skipped\n",
+                appends_per_s, log_bytes_per_day(), log_stats.compactions, log_stats.last_query_ms,
+                log_stats.dropped, log_stats.write_errors, log_stats.corrupt_records);
+}
+
+void sensor_log_task(void *parameter)
+{
+  static bool started = false; // survives a restart by the supervisor
+  if (!started)
+  {
+    started = true;
+    log_ready = log_begin();
+  }
+
+  for (;;)
+  {
+    SensorSample sample;
+    if (xQueueReceive(log_queue, &sample, 1000 / portTICK_PERIOD_MS) == pdTRUE && log_ready)
+      log_add(sample);
+    task_safe_point();
+  }
+}
+
+/*
+   Sensor history
+*/
+void record_sensor_history()
+{
+  static unsigned long last_sample = 0;
+  if (history_total > 0 && millis() - last_sample < HISTORY_INTERVAL_MS)
+    return;
+  last_sample = millis();
+
+  SensorSample sample;
+  sample.time = clock_now();
+  for (int i = 0; i < SENSOR_MAX_QUANTITIES; i++)
+    sample.values[i] = i < quantity_count ? quantities[i].value : SENSOR_MISSING;
+
+  portENTER_CRITICAL(&history_mux);
+  sensor_history[history_total % HISTORY_SIZE] = sample;
+  history_total++;
+  portEXIT_CRITICAL(&history_mux);
+
+  xQueueSend(log_queue, &sample, 0);
+}
+
+// Copies out sample number seq. Fails once it has been overwritten.
+bool get_history_sample(uint32_t seq, SensorSample &sample)
+{
+  bool ok;
+  portENTER_CRITICAL(&history_mux);
+  ok = seq < history_total && history_total - seq <= HISTORY_SIZE;
+  if (ok)
+    sample = sensor_history[seq % HISTORY_SIZE];
+  portEXIT_CRITICAL(&history_mux);
+  return ok;
+}
+
+/*
+   HTTP dashboard
+
+   Responses use chunked transfer encoding. Rows are formatted straight from
+   the history ring into one fixed chunk buffer, which is sent whenever it
+   fills, so a full history download needs no more memory than one chunk.
+*/
+WiFiServer http_server(HTTP_PORT);
+
+struct ChunkedResponse
+{
+  WiFiClient *client;
+  char buffer[HTTP_CHUNK_SIZE];
+  size_t length;
+  uint32_t heap_min;
+};
+
+void http_flush_chunk(ChunkedResponse &response)
+{
+  if (response.length == 0)
+    return;
+
+  response.client->printf("%x\r\n", (unsigned)response.length);
+  response.client->write((const uint8_t *)response.buffer, response.length);
+  response.client->print("\r\n");
+  response.length = 0;
+
+  uint32_t heap = ESP.getFreeHeap();
+  if (heap < response.heap_min)
+    response.heap_min = heap;
+}
+
+void http_printf(ChunkedResponse &response, const char *format, ...)
+{
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    va_list args;
+    va_start(args, format);
+    size_t space = HTTP_CHUNK_SIZE - response.length;
+    int n = vsnprintf(response.buffer + response.length, space, format, args);
+    va_end(args);
+
+    if (n >= 0 && (size_t)n < space)
+    {
+      response.length += n;
+      return;
+    }
+    http_flush_chunk(response); // did not fit, retry in an empty chunk
+  }
+}
+
+void http_begin(ChunkedResponse &response, WiFiClient &client, int status, const char *content_type)
+{
+  response.client = &client;
+  response.length = 0;
+  response.heap_min = ESP.getFreeHeap();
+  client.printf("HTTP/1.1 %d %s\r\n"
+                "Content-Type: %s\r\n"
+                "Transfer-Encoding: chunked\r\n"
+                "Connection: close\r\n\r\n",
+                status, status == 200 ? "OK" : "Not Found", content_type);
+}
+
+void http_end(ChunkedResponse &response)
+{
+  http_flush_chunk(response);
+  response.client->print("0\r\n\r\n");
+}
+
+// The quantity names as CSV columns, each with suffix
+void http_send_names(ChunkedResponse &response, const char *suffix)
+{
+  for (int i = 0; i < quantity_count; i++)
+    http_printf(response, ",%s%s", quantities[i].info->name, suffix);
+}
+
+// One value per quantity slot, as CSV fields or JSON members. A missing
+// reading is an empty field or null.
+void http_send_values(ChunkedResponse &response, const int16_t *values, bool json)
+{
+  for (int i = 0; i < quantity_count; i++)
+  {
+    if (json)
+      http_printf(response, values[i] == SENSOR_MISSING ? ",\"%s\":null" : ",\"%s\":%d", quantities[i].info->name, values[i]);
+    else
+      http_printf(response, values[i] == SENSOR_MISSING ? "," : ",%d", values[i]);
+  }
+}
+
+void http_send_current(ChunkedResponse &response)
+{
+  int16_t values[SENSOR_MAX_QUANTITIES];
+  for (int i = 0; i < quantity_count; i++)
+    values[i] = quantities[i].value;
+  int aqi = sensor_aqi;
+
+  http_printf(response, "{\"time\":%lu", (unsigned long)clock_now());
+  http_send_values(response, values, true);
+  http_printf(response, ",\"aqi\":%d,\"pm2_5_aqi\":%d,\"pm10_aqi\":%d,\"aqi_category\":\"%s\","
+                        "\"urgency\":%d,\"sample_interval_ms\":%u,\"publish_interval_s\":%u}\n",
+              aqi, aqi_pm2_5, aqi_pm10, aqi < 0 ? "" : aqi_categories[aqi_category(aqi)][1],
+              sensor_urgency, sample_interval_ms, publish_effective_s);
+}
+
+void http_send_history(ChunkedResponse &response, bool json)
+{
+  uint32_t end = history_total;
+  uint32_t seq = end > HISTORY_SIZE ? end - HISTORY_SIZE : 0;
+  bool first = true;
+  SensorSample s;
+
+  if (json)
+  {
+    http_printf(response, "[");
+  }
+  else
+  {
+    http_printf(response, "time");
+    http_send_names(response, "");
+    http_printf(response, "\n");
+  }
+  for (; seq < end; seq++)
+  {
+    if (!get_history_sample(seq, s))
+      continue; // overwritten while streaming
+
+    if (json)
+      http_printf(response, "%s\n{\"time\":%u", first ? "" : ",", s.time);
+    else
+      http_printf(response, "%u", s.time);
+    http_send_values(response, s.values, json);
+    http_printf(response, json ? "}" : "\n");
+    first = false;
+  }
+  if (json)
+    http_printf(response, "\n]\n");
+}
+
+// query is "?from=<utc>&to=<utc>", both optional
+void http_send_log(ChunkedResponse &response, const char *query)
+{
+  uint32_t from = 0, to = UINT32_MAX;
+  const char *value;
+  if ((value = strstr(query, "from=")))
+    from = strtoul(value + 5, NULL, 10);
+  if ((value = strstr(query, "to=")))
+    to = strtoul(value + 3, NULL, 10);
+
+  http_printf(response, "time,samples");
+  http_send_names(response, "");
+  http_send_names(response, "_max");
+  http_printf(response, "\n");
+  LogQuery q;
+  LogRecord records[LOG_QUERY_BATCH];
+  int n;
+  log_query_begin(q, from, to);
+  while ((n = log_query_next(q, records, LOG_QUERY_BATCH)) > 0)
+  {
+    for (int i = 0; i < n; i++)
+    {
+      const LogRecord &r = records[i];
+      http_printf(response, "%u,%u", r.time, r.samples);
+      http_send_values(response, r.mean, false);
+      http_send_values(response, r.max, false);
+      http_printf(response, "\n");
+    }
+  }
+  log_query_end(q);
 }
 
-void create_symbols()
+// requests_per_s is what the server sustains while busy, heap_peak is the
+// most heap a single request has used
+void http_send_stats(ChunkedResponse &response)
 {
-  LCD.createChar(1, BELL);
-  LCD.createChar(2, MENU_LEFT_ARROW);
-  LCD.createChar(3, MENU_RIGHT_ARROW);
-  LCD.createChar(4, THERMOMETER);
-  // LCD.createChar(5, CHAR_A);
-  // LCD.createChar(6, CHAR_L);
-  // LCD.createChar(7, CHAR_C);
-  LCD.createChar(5, CHAR_EXCL);
-  LCD.createChar(6, WATER_DROPLET);
-  LCD.createChar(7, MU);
-  LCD.createChar(8, POWER_THREE);
+  float busy_s = http_stats.busy_us / 1e6;
+  http_printf(response, "{\"requests\":%u,\"requests_per_s\":%.1f,\"last_request_us\":%u,\"heap_peak\":%u}\n",
+              http_stats.requests, busy_s > 0 ? http_stats.requests / busy_s : 0.0,
+              http_stats.last_request_us, http_stats.heap_peak);
 }
 
-void IRAM_ATTR onTimer()
+void http_metric(ChunkedResponse &response, const char *name, const char *help, const char *type, double value)
 {
-  xSemaphoreGiveFromISR(sendReadySemaphore, NULL);
+  http_printf(response, "# HELP %s %s\n# TYPE %s %s\n%s %.10g\n", name, help, name, type, name, value);
 }
 
-void IRAM_ATTR onKeepAliveTimer()
+void http_send_metrics(ChunkedResponse &response)
 {
-  xSemaphoreGiveFromISR(sendKeepAliveSemaphore, NULL);
-}
+  for (int i = 0; i < COUNTER_COUNT; i++)
+    http_metric(response, counter_info[i].name, counter_info[i].help, "counter", counters[i].load());
 
-void WIFI_MQTT_connection()
-{
-  bool wifi_conn = false;
-  bool mqtt_conn = false;
-  while (!wifi_conn || !mqtt_conn)
+  http_printf(response, "# HELP alarm_clock_fsm_state_entries_total Times each FSM state was entered\n"
+                        "# TYPE alarm_clock_fsm_state_entries_total counter\n");
+  for (int i = 0; i < STATE_COUNT; i++)
+    http_printf(response, "alarm_clock_fsm_state_entries_total{state=\"%s\"} %u\n", state_names[i], state_entries[i].load());
+
+  for (int i = 0; i < HISTOGRAM_COUNT; i++)
   {
-    // Check if WiFi is connected
-    if (WiFi.status() == WL_CONNECTED)
+    portENTER_CRITICAL(&metrics_mux);
+    Histogram h = histograms[i];
+    portEXIT_CRITICAL(&metrics_mux);
+
+    const char *name = histogram_info[i].name;
+    http_printf(response, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[i].help, name);
+    uint32_t cumulative = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
     {
-      wifi_conn = true;
-      // Serial.println("WiFi still conneted");
-      // vTaskDelay(500/portTICK_PERIOD_MS);
-      // Check if MQTT Server is connected
-      if (!mqtt.connected())
-      {
-        mqtt.connect(clientID, mqttUserName, mqttPass);
-        if (!mqtt.connected())
-        {
-          mqtt_conn = false;
-          vTaskDelay(500 / portTICK_PERIOD_MS);
-          Serial.print(".");
-          continue;
-        }
-      }
-      mqtt_conn = true;
+      cumulative += h.buckets[b];
+      http_printf(response, "%s_bucket{le=\"%u\"} %u\n", name, h.bounds[b], cumulative);
     }
-    else
-    {
-      wifi_conn = false;
-      Serial.println("WiFi connecting");
-      WiFi.mode(WIFI_STA);
-      WiFi.begin(SSID, PASS);
+    http_printf(response, "%s_bucket{le=\"+Inf\"} %u\n%s_sum %llu\n%s_count %u\n",
+                name, h.count, name, h.sum, name, h.count);
+  }
 
-      unsigned long startAttemptTime = millis();
-      while (WiFi.status() != WL_CONNECTED && millis() - startAttemptTime < WIFI_EVENT_MAX)
-      {
-      }
-      if (WiFi.status() != WL_CONNECTED)
-      {
-        Serial.println("WiFi Failed");
-        vTaskDelay(5000 / portTICK_PERIOD_MS);
-        continue;
-      }
-    }
+  http_printf(response, "# HELP alarm_clock_deadline_violations_total Missed task deadlines by FSM state\n"
+                        "# TYPE alarm_clock_deadline_violations_total counter\n");
+  for (int i = 0; i < STATE_COUNT; i++)
+    http_printf(response, "alarm_clock_deadline_violations_total{state=\"%s\"} %u\n", state_names[i], deadline_violations[i].load());
+
+  http_printf(response, "# HELP alarm_clock_task_restarts_total Tasks restarted by the supervisor\n"
+                        "# TYPE alarm_clock_task_restarts_total counter\n");
+  for (SupervisedTask &task : supervised_tasks)
+    http_printf(response, "alarm_clock_task_restarts_total{task=\"%s\"} %u\n", task.name, task.restarts);
+
+  http_printf(response, "# HELP alarm_clock_task_stall_max_ms Longest time a task went without a heartbeat\n"
+                        "# TYPE alarm_clock_task_stall_max_ms gauge\n");
+  for (SupervisedTask &task : supervised_tasks)
+    http_printf(response, "alarm_clock_task_stall_max_ms{task=\"%s\"} %u\n", task.name, task.worst_ms);
+
+  // Counters the other subsystems already keep
+  http_metric(response, "alarm_clock_i2c_transactions_total", "I2C bus transactions", "counter", i2c_stats.transactions);
+  http_metric(response, "alarm_clock_i2c_nacks_total", "I2C NACKs", "counter", i2c_stats.nacks);
+  http_metric(response, "alarm_clock_i2c_timeouts_total", "I2C timeouts", "counter", i2c_stats.timeouts);
+  http_metric(response, "alarm_clock_i2c_bus_clears_total", "I2C bus clear recoveries", "counter", i2c_stats.bus_clears);
+  http_metric(response, "alarm_clock_cgram_uploads_total", "Glyphs uploaded to CGRAM", "counter", cgram_uploads);
+  http_metric(response, "alarm_clock_ui_allocations_total", "Heap allocations made by the UI task", "counter", ui_allocations.load());
+  http_metric(response, "alarm_clock_http_requests_total", "HTTP requests served", "counter", http_stats.requests);
+  http_metric(response, "alarm_clock_button_scan_cycles_max", "Worst button scan in CPU cycles", "gauge", button_scan_cycles_max);
+  http_metric(response, "alarm_clock_fsm_tick_jitter_stddev_us", "FSM tick period standard deviation over the last window", "gauge", tick_jitter_stddev_us(tick_jitter_last));
+  http_metric(response, "alarm_clock_fsm_tick_jitter_max_us", "Latest FSM tick over the last window", "gauge", tick_jitter_last.max_us);
+  http_metric(response, "alarm_clock_aqi", "US EPA AQI from the PM NowCast, -1 without enough data", "gauge", sensor_aqi);
+  http_printf(response, "# HELP alarm_clock_sensor_value Latest reading of each sensor quantity\n"
+                        "# TYPE alarm_clock_sensor_value gauge\n");
+  for (int i = 0; i < quantity_count; i++)
+  {
+    int value = quantities[i].value;
+    if (value != SENSOR_MISSING)
+      http_printf(response, "alarm_clock_sensor_value{quantity=\"%s\",unit=\"%s\"} %d\n",
+                  quantities[i].info->name, quantities[i].info->unit, value);
   }
+  http_metric(response, "alarm_clock_sensor_urgency", "Highest sensor urgency, 0 to 100", "gauge", sensor_urgency);
+  http_metric(response, "alarm_clock_sample_interval_ms", "Current DHT sample interval", "gauge", sample_interval_ms);
+  http_metric(response, "alarm_clock_publish_interval_seconds", "Current publish interval", "gauge", publish_effective_s);
+  http_metric(response, "alarm_clock_publish_offset_ms", "This clock's place in the publish period", "gauge",
+              publish_offset_ms(clientID, publish_effective_s * 1000UL));
+  http_metric(response, "alarm_clock_boots", "Boots since power on", "gauge", postmortem.boot_count);
+  http_metric(response, "alarm_clock_crashes_total", "Panic, watchdog and brownout resets since power on", "counter", postmortem.crash_count);
+  http_metric(response, "alarm_clock_crash_streak", "Crashes since the last boot that ran 10 minutes", "gauge", postmortem.crash_streak);
+  http_printf(response, "# HELP alarm_clock_sensor_reads_total Sensor driver reads\n"
+                        "# TYPE alarm_clock_sensor_reads_total counter\n");
+  for (SensorDriver &driver : sensor_drivers)
+    http_printf(response, "alarm_clock_sensor_reads_total{driver=\"%s\",result=\"ok\"} %u\n"
+                          "alarm_clock_sensor_reads_total{driver=\"%s\",result=\"failed\"} %u\n",
+                driver.name, driver.reads, driver.name, driver.failures);
+
+  http_printf(response, "# HELP alarm_clock_cpu_busy_percent Busy time per core\n"
+                        "# TYPE alarm_clock_cpu_busy_percent gauge\n");
+  for (int core = 0; core < portNUM_PROCESSORS; core++)
+    http_printf(response, "alarm_clock_cpu_busy_percent{core=\"%d\",window=\"10s\"} %d\n"
+                          "alarm_clock_cpu_busy_percent{core=\"%d\",window=\"60s\"} %d\n",
+                core, cpu_busy(core, 10), core, cpu_busy(core, 60));
+
+  http_metric(response, "alarm_clock_alarm_latency_max_us", "Longest time from the RTC alarm interrupt to the buzzer", "gauge", alarm_latency_max_us);
+
+  http_metric(response, "alarm_clock_log_appends_total", "Samples added to the sensor log", "counter", log_stats.appends);
+  http_metric(response, "alarm_clock_log_bytes_written_total", "Bytes appended to the sensor log files", "counter", log_stats.bytes_written);
+  http_metric(response, "alarm_clock_log_compactions_total", "Raw log segments compacted into hourly aggregates", "counter", log_stats.compactions);
+  http_metric(response, "alarm_clock_log_corrupt_records_total", "Sensor log records skipped for a bad CRC", "counter", log_stats.corrupt_records);
+  http_metric(response, "alarm_clock_log_bytes_per_day", "Sensor log write rate since boot", "gauge", log_bytes_per_day());
+#ifdef SERIAL_TELEMETRY
+  http_metric(response, "alarm_clock_telemetry_frames_total", "Telemetry frames queued", "counter", telemetry_stats.frames);
+  http_metric(response, "alarm_clock_telemetry_dropped_total", "Telemetry frames dropped on a full ring", "counter", telemetry_stats.dropped);
+#endif
+
+  http_metric(response, "alarm_clock_free_heap_bytes", "Free heap", "gauge", ESP.getFreeHeap());
+  http_metric(response, "alarm_clock_wifi_rssi_dbm", "WiFi signal strength", "gauge", WiFi.RSSI());
+  http_metric(response, "alarm_clock_uptime_seconds", "Time since boot", "gauge", millis() / 1000);
 }
 
-void keep_alive_task(void *parameter)
+void http_handle(WiFiClient &client)
+{
+  unsigned long start = micros();
+  uint32_t heap_before = ESP.getFreeHeap();
+  char line[96];
+  char header[96];
+
+  client.setTimeout(2000);
+  size_t n = client.readBytesUntil('\n', line, sizeof(line) - 1);
+  line[n] = '\0';
+
+  // Skip the headers, nothing in them matters here
+  while (client.connected() && client.readBytesUntil('\n', header, sizeof(header)) > 1)
+  {
+  }
+
+  char path[64] = "";
+  sscanf(line, "GET %63s", path);
+
+  ChunkedResponse response;
+  if (strcmp(path, "/") == 0)
+  {
+    http_begin(response, client, 200, "text/html");
+    http_printf(response, "<html><body><h1>ESP32 Alarm Clock</h1><ul>"
+                          "<li><a href=\"/current.json\">current.json</a></li>"
+                          "<li><a href=\"/history.csv\">history.csv</a></li>"
+                          "<li><a href=\"/history.json\">history.json</a></li>"
+                          "<li><a href=\"/log.csv\">log.csv</a></li>"
+                          "<li><a href=\"/stats.json\">stats.json</a></li>"
+                          "<li><a href=\"/metrics\">metrics</a></li>"
+                          "</ul></body></html>\n");
+  }
+  else if (strcmp(path, "/current.json") == 0)
+  {
+    http_begin(response, client, 200, "application/json");
+    http_send_current(response);
+  }
+  else if (strcmp(path, "/history.csv") == 0)
+  {
+    http_begin(response, client, 200, "text/csv");
+    http_send_history(response, false);
+  }
+  else if (strcmp(path, "/history.json") == 0)
+  {
+    http_begin(response, client, 200, "application/json");
+    http_send_history(response, true);
+  }
+  else if (strncmp(path, "/log.csv", 8) == 0 && (path[8] == '\0' || path[8] == '?'))
+  {
+    http_begin(response, client, 200, "text/csv");
+    http_send_log(response, path + 8);
+  }
+  else if (strcmp(path, "/metrics") == 0)
+  {
+    http_begin(response, client, 200, "text/plain; version=0.0.4");
+    http_send_metrics(response);
+  }
+  else if (strcmp(path, "/stats.json") == 0)
+  {
+    http_begin(response, client, 200, "application/json");
+    http_send_stats(response);
+  }
+  else
+  {
+    http_begin(response, client, 404, "text/plain");
+    http_printf(response, "Not found\n");
+  }
+  http_end(response);
+  client.stop();
+
+  http_stats.requests++;
+  http_stats.last_request_us = micros() - start;
+  http_stats.busy_us += http_stats.last_request_us;
+  if (heap_before > response.heap_min && heap_before - response.heap_min > http_stats.heap_peak)
+    http_stats.heap_peak = heap_before - response.heap_min;
+}
+
+void http_task(void *parameter)
 {
+  static bool started = false; // survives a restart by the supervisor
   for (;;)
   {
-    static bool firstrun = true;
-    if (firstrun)
-    {                                       // setup for this task
-      vTaskDelay(200 / portTICK_PERIOD_MS); // to let other task do first
-      firstrun = false;
-      xSemaphoreGive(sendKeepAliveSemaphore);
-      timerAlarmEnable(keepAlive);
+    task_safe_point();
+    if (WiFi.status() != WL_CONNECTED)
+    {
+      vTaskDelay(1000 / portTICK_PERIOD_MS);
+      continue;
     }
-
-    if (xSemaphoreTake(sendKeepAliveSemaphore, 1) == pdTRUE)
+    if (!started)
     {
-      WIFI_MQTT_connection();
-      String dataString = "&field6=1";
-      String topicString = "channels/" + String(channelID) + "/publish";
-      mqtt.publish(topicString.c_str(), dataString.c_str());
-      Serial.println(dataString);
+      http_server.begin();
+      started = true;
     }
+
+    WiFiClient client = http_server.available();
+    if (client)
+      http_handle(client);
+    else
+      vTaskDelay(10 / portTICK_PERIOD_MS);
   }
 }
 
-void alarm_clock_task(void *parameter)
+int mqtt_payload(char *payload, size_t size)
 {
-  for (;;)
+  // The channel's fields are fixed, so they are picked by name
+  int aqi = sensor_aqi;
+  PublishReadings readings = {
+      quantity_value("humidity"), quantity_value("temperature"), quantity_value("pm1"), quantity_value("pm2_5"), quantity_value("pm10"),
+      aqi, aqi_pm2_5, aqi_pm10, aqi < 0 ? "" : aqi_categories[aqi_category(aqi)][0]};
+  return format_sensor_payload(payload, size, readings);
+}
+
+// RTC time in milliseconds. The clock only has whole seconds, so millis() fills
+// in between and the anchor moves whenever the two disagree by a second.
+uint64_t wall_clock_ms()
+{
+  static time_t anchor_s = 0;
+  static unsigned long anchor_ms = 0;
+  time_t t = clock_now();
+  unsigned long elapsed_ms = millis() - anchor_ms;
+  time_t expected_s = anchor_s + elapsed_ms / 1000;
+  if (anchor_s == 0 || t > expected_s + 1 || t + 1 < expected_s)
   {
-    fsm.run_machine();
-    vTaskDelay(100 / portTICK_PERIOD_MS);
+    anchor_s = t;
+    anchor_ms = millis();
+    elapsed_ms = 0;
   }
+  return anchor_s * 1000ULL + elapsed_ms;
 }
 
+/*
+   Sensor publishes run on the wall-clock grid from include/publish.h, at
+   the current adaptive period. Alerts still publish at once through
+   sendReadySemaphore but leave the grid alone. A slot closer than half the
+   minimum interval to the previous publish is skipped, which keeps the
+   channel under its rate limit.
+*/
 void send_mqtt_task(void *parameter)
 {
+  uint64_t last_publish_wall_ms = wall_clock_ms() - publish_min_interval_s * 500UL;
   for (;;)
   {
-    // Serial.println("in T1");
+    task_safe_point();
+
+    uint32_t period_ms = publish_effective_s * 1000UL;
+    uint64_t due_ms = publish_slot_after(last_publish_wall_ms + publish_min_interval_s * 500UL, period_ms,
+                                         publish_offset_ms(clientID, period_ms));
+    uint64_t now_ms = wall_clock_ms();
+    bool publish = now_ms >= due_ms;
+    if (!publish)
+    {
+      // Wake at least once a second, so the deadline follows the period as urgency changes
+      uint32_t wait_ms = min(due_ms - now_ms, (uint64_t)1000);
+      publish = xSemaphoreTake(sendReadySemaphore, pdMS_TO_TICKS(wait_ms)) == pdTRUE;
+    }
 
-    if (xSemaphoreTake(sendReadySemaphore, 1) == pdTRUE)
+    if (publish)
     {
       timerStop(keepAlive);
-      WIFI_MQTT_connection();
-      String dataString = "&field1=" + String(sensor_values.humidity) + "&field2=" + String(sensor_values.temperature) + "&field3=" + String(sensor_values.pm1) + "&field4=" + String(sensor_values.pm2_5) + "&field5=" + String(sensor_values.pm10);
-      String topicString = "channels/" + String(channelID) + "/publish";
-      Serial.println(dataString);
-      mqtt.publish(topicString.c_str(), dataString.c_str());
+      if (WIFI_MQTT_connection())
+      {
+        char payload[PUBLISH_PAYLOAD_SIZE];
+        char topic[64];
+        mqtt_payload(payload, sizeof(payload));
+        format_publish_topic(topic, sizeof(topic), channelID);
+        Serial.println(payload);
+        publish_mqtt(topic, payload);
+      }
+      last_publish_wall_ms = wall_clock_ms();
       timerStart(keepAlive);
     }
   }
@@ -613,101 +4894,138 @@ void send_mqtt_task(void *parameter)
 
 void setup()
 {
-  Wire.begin(SDA, SCL);
+  time_mutex = xSemaphoreCreateMutexStatic(&time_mutex_buffer);
+  postmortem_begin();
+  ota_begin_verify();
+  i2c_init();
+#ifdef SERIAL_TELEMETRY
+  Serial.setTxBufferSize(1024);
+  Serial.begin(921600);
+#else
   Serial.begin(9600);
+#endif
   EEPROM.begin(EEPROM_SIZE);
-  softwareSerial.begin(9600);
-  buttonLeft.begin();
-  buttonRight.begin();
-  buttonUp.begin();
-  buttonDown.begin();
-  buttonOK.begin();
-  buttonBack.begin();
-  dht.begin();
+  start_sensors();
+  begin_buttons();
 
-  connect_wifi();
-  create_symbols();
+  // Bring up everything the clock face needs first, networking comes last
+  LCD.init();
+  LCD.backlight();
+  cgram_reset();
   LCD.clear();
-
-  vTaskDelay(1000 / portTICK_PERIOD_MS);
+#ifdef LCD_BENCHMARK
+  lcd_benchmark();
+#endif
 
   pinMode(ALARM_OUT, OUTPUT);
   pinMode(SQW_PIN, INPUT_PULLUP);
   attachInterrupt(digitalPinToInterrupt(SQW_PIN), alarm_isr, FALLING);
 
   fsm_add_transitions();
-  setSyncProvider(RTC.get);
+  setSyncProvider(rtc_get);
   setSyncInterval(5);
+  i2c_begin(RTC_ADDRESS);
   RTC.squareWave(DS3232RTC::SQWAVE_NONE);
+  i2c_end();
+
+  // Clocks set before the RTC kept UTC hold local time; convert them once
+  if (EEPROM.read(EEPROM_RTC_UTC) != RTC_UTC_MARK)
+  {
+    tmElements_t local;
+    time_t t = rtc_get();
+    if (t != 0)
+    {
+      breakTime(t, local);
+      write_local_time(local);
+      EEPROM.write(EEPROM_RTC_UTC, RTC_UTC_MARK);
+      EEPROM.commit();
+    }
+  }
+
+  // The tasks take these right away, so they must exist before the tasks do
+  sendReadySemaphore = xSemaphoreCreateBinaryStatic(&sendReadySemaphore_buffer);
+  sendKeepAliveSemaphore = xSemaphoreCreateBinaryStatic(&sendKeepAliveSemaphore_buffer);
+  mqtt_mutex = xSemaphoreCreateRecursiveMutexStatic(&mqtt_mutex_buffer);
+  command_queue = xQueueCreateStatic(COMMAND_QUEUE_LENGTH, sizeof(Command), command_queue_storage, &command_queue_buffer);
+  command_ack_queue =
+      xQueueCreateStatic(COMMAND_QUEUE_LENGTH, sizeof(CommandAck), command_ack_queue_storage, &command_ack_queue_buffer);
+  log_queue = xQueueCreateStatic(LOG_QUEUE_LENGTH, sizeof(SensorSample), log_queue_storage, &log_queue_buffer);
+  log_mutex = xSemaphoreCreateMutexStatic(&log_mutex_buffer);
+
+  cpu_usage_begin();
 
   mqtt.setServer(server, 1883);
+  mqtt.setCallback(on_mqtt_message);
+  mqtt.setKeepAlive(MQTT_KEEP_ALIVE_S);
+  connect_wifi();
 
-  // WiFi need to run on core that arduino runs
-  xTaskCreatePinnedToCore(
-      alarm_clock_task,   /* Function to implement the task */
-      "alarm_clock_task", /* Name of the task */
-      5120,               /* Stack size in words */
-      NULL,               /* Task input parameter */
-      1,                  /* Priority of the task */
-      &Task0,             /* Task handle. */
-      0);                 /* Core where the task should run */
-  xTaskCreatePinnedToCore(
-      send_mqtt_task,   /* Function to implement the task */
-      "send_mqtt_task", /* Name of the task */
-      5120,             /* Stack size in words */
-      NULL,             /* Task input parameter */
-      1,                /* Priority of the task */
-      &Task1,           /* Task handle. */
-      1);               /* Core where the task should run */
-
-  xTaskCreatePinnedToCore(
-      keep_alive_task,   /* Function to implement the task */
-      "keep_alive_task", /* Name of the task */
-      5120,              /* Stack size in words */
-      NULL,              /* Task input parameter */
-      1,                 /* Priority of the task */
-      &Task2,            /* Task handle. */
-      1);                /* Core where the task should run */
-
-  timer = timerBegin(0, 80, true);             // 80 prescaler for 1MHz clock_settings, count up
-  timerAttachInterrupt(timer, &onTimer, true); // Attach ISR
-  // timerAlarmWrite(timer, 1800000000, true);  // 30 minutes in microseconds
-  timerAlarmWrite(timer, 150000000, true); // 3 minutes
-  timerAlarmEnable(timer);
+  esp_task_wdt_init(TASK_WDT_TIMEOUT_S, true);
+  for (SupervisedTask &task : supervised_tasks)
+    start_task(task);
+
+  Task4 = xTaskCreateStaticPinnedToCore(
+      supervisor_task,                 /* Function to implement the task */
+      "supervisor_task",               /* Name of the task */
+      STACK_DEPTH(supervisor_stack),   /* Stack size in words */
+      NULL,                            /* Task input parameter */
+      SUPERVISOR_PRIORITY,             /* Priority of the task */
+      supervisor_stack,                /* Task stack */
+      &supervisor_tcb,                 /* Task control block */
+      UI_CORE);                        /* Core where the task should run */
+
+  alarm_task_handle = xTaskCreateStaticPinnedToCore(
+      alarm_task,                      /* Function to implement the task */
+      "alarm_task",                    /* Name of the task */
+      STACK_DEPTH(alarm_stack),        /* Stack size in words */
+      NULL,                            /* Task input parameter */
+      ALARM_PRIORITY,                  /* Priority of the task */
+      alarm_stack,                     /* Task stack */
+      &alarm_tcb,                      /* Task control block */
+      UI_CORE);                        /* Core where the task should run */
+
+#ifdef SERIAL_TELEMETRY
+  xTaskCreateStaticPinnedToCore(
+      telemetry_task,                  /* Function to implement the task */
+      "telemetry_task",                /* Name of the task */
+      STACK_DEPTH(telemetry_stack),    /* Stack size in words */
+      NULL,                            /* Task input parameter */
+      NET_PRIORITY,                    /* Priority of the task */
+      telemetry_stack,                 /* Task stack */
+      &telemetry_tcb,                  /* Task control block */
+      NET_CORE);                       /* Core where the task should run */
+#endif
 
   // Set up timer for MQTT keep-alive
   keepAlive = timerBegin(1, 80, true);
   timerAttachInterrupt(keepAlive, &onKeepAliveTimer, true);
-  timerAlarmWrite(keepAlive, 60000000, true);
-
-  sendReadySemaphore = xSemaphoreCreateBinary();
-  sendKeepAliveSemaphore = xSemaphoreCreateBinary();
-  xSemaphoreGive(sendReadySemaphore);
+  timerAlarmWrite(keepAlive, KEEP_ALIVE_INTERVAL_S * 1000000ULL, true);
 }
 
-void loop() {}
+// Everything runs in the tasks above, so hand back the loop task's stack
+void loop() { vTaskDelete(NULL); }
 
 void get_time()
 {
-  Wire.beginTransmission(0x68);
-  Wire.write(0); // set register to zero
-  Wire.endTransmission();
-  Wire.requestFrom(0x68, 3); // 3 bytes (sec, min, hour)
-  clock_settings.time.second = bcd2dec(Wire.read() & 0x7f);
-  clock_settings.time.minute = bcd2dec(Wire.read());
-  clock_settings.time.hour = bcd2dec(Wire.read() & 0x3f);
+  tmElements_t local;
+  if (!read_local_time(local))
+    return;
+
+  clock_settings.time.second = local.Second;
+  clock_settings.time.minute = local.Minute;
+  clock_settings.time.hour = local.Hour;
 }
 
 void set_time()
 {
-  Wire.beginTransmission(0x68);
-  Wire.write(0x00);
+  tmElements_t local;
+  if (!read_local_time(local))
+    return;
+
   clock_settings.time.second = 0;
-  Wire.write(dec2bcd(clock_settings.time.second));
-  Wire.write(dec2bcd(clock_settings.time.minute));
-  Wire.write(dec2bcd(clock_settings.time.hour));
-  Wire.write(0x00);
-  Wire.endTransmission();
+  local.Second = clock_settings.time.second;
+  local.Minute = clock_settings.time.minute;
+  local.Hour = clock_settings.time.hour;
+  write_local_time(local);
 }
 
 void on_time_set()
@@ -734,24 +5052,25 @@ void display_time(int row, int col)
 
 void get_date()
 {
-  Wire.beginTransmission(0x68);
-  Wire.write(4); // set register to 3 (day)
-  Wire.endTransmission();
-  Wire.requestFrom(0x68, 3); // 3 bytes (day, month, year) - DOW get from Time.h library
-  clock_settings.date.day = bcd2dec(Wire.read());
-  clock_settings.date.month = bcd2dec(Wire.read());
-  clock_settings.date.year = bcd2dec(Wire.read());
+  tmElements_t local;
+  if (!read_local_time(local))
+    return;
+
+  clock_settings.date.day = local.Day;
+  clock_settings.date.month = local.Month;
+  clock_settings.date.year = tmYearToCalendar(local.Year);
 }
 
 void set_date()
 {
-  Wire.beginTransmission(0x68);
-  Wire.write(4);
-  // Wire.write(dec2bcd(DoW));
-  Wire.write(dec2bcd(clock_settings.date.day));
-  Wire.write(dec2bcd(clock_settings.date.month));
-  Wire.write(dec2bcd(clock_settings.date.year));
-  Wire.endTransmission();
+  tmElements_t local;
+  if (!read_local_time(local))
+    return;
+
+  local.Day = clock_settings.date.day;
+  local.Month = clock_settings.date.month;
+  local.Year = CalendarYrToTm(clock_settings.date.year);
+  write_local_time(local);
 }
 
 void on_date_set()
@@ -773,38 +5092,14 @@ void display_date(int row, int col)
   LCD.print("/");
   display_position(clock_settings.date.month);
   LCD.print("/");
-  display_position(clock_settings.date.year);
+  display_position(clock_settings.date.year % 100); // no room for the century
 }
 
 void display_date_of_week(int row, int col)
 {
-  dow = weekday();
-  switch (dow)
-  {
-  case 1:
-    day_of_week = "Sun";
-    break;
-  case 2:
-    day_of_week = "Mon";
-    break;
-  case 3:
-    day_of_week = "Tue";
-    break;
-  case 4:
-    day_of_week = "Wed";
-    break;
-  case 5:
-    day_of_week = "Thu";
-    break;
-  case 6:
-    day_of_week = "Fri";
-    break;
-  case 7:
-    day_of_week = "Sat";
-    break;
-  }
+  dow = weekday(utc_to_local(clock_now()));
   LCD.setCursor(row, col);
-  LCD.print(day_of_week);
+  LCD.print(day_name(dow));
 }
 
 void set_alarm()
@@ -814,9 +5109,24 @@ void set_alarm()
   EEPROM.write(2, clock_settings.alarm.active);
   EEPROM.commit();
 
-  RTC.setAlarm(DS3232RTC::ALM1_MATCH_HOURS, 0, clock_settings.alarm.minute, clock_settings.alarm.hour, 0);
+  i2c_begin(RTC_ADDRESS);
   RTC.alarm(DS3232RTC::ALARM_1); // ensure RTC interrupt flag is cleared
+  i2c_end();
+  program_alarm();
+}
+
+// The DS3231 matches its alarm against UTC, so the local alarm time is
+// converted with the offset in effect and reprogrammed when the offset changes
+void program_alarm()
+{
+  int32_t offset = tz_offset(clock_now());
+  int minutes = ((clock_settings.alarm.hour * 60 + clock_settings.alarm.minute - offset / 60) % 1440 + 1440) % 1440;
+
+  i2c_begin(RTC_ADDRESS);
+  RTC.setAlarm(DS3232RTC::ALM1_MATCH_HOURS, 0, minutes % 60, minutes / 60, 0);
   RTC.alarmInterrupt(DS3232RTC::ALARM_1, clock_settings.alarm.active);
+  i2c_end();
+  alarm_offset_s = offset;
 }
 
 void get_alarm()
@@ -830,16 +5140,21 @@ void get_alarm()
     clock_settings.alarm.minute = 0;
 
   clock_settings.alarm.active = EEPROM.read(2);
+}
+
+void display_alarm_indicator(int col, int row)
+{
   if (clock_settings.alarm.active)
   {
-    LCD.setCursor(4, 1);
+    uint8_t bell = glyph_slot(GLYPH_BELL);
+    LCD.setCursor(col, row);
     LCD.print(" ");
-    LCD.write(1);
+    LCD.write(bell);
     LCD.print("  ");
   }
   else
   {
-    LCD.setCursor(4, 1);
+    LCD.setCursor(col, row);
     LCD.print("    ");
   }
 }
@@ -855,81 +5170,23 @@ void on_alarm_set()
   LCD.clear();
 }
 
-void get_temperature_humidity()
-{
-  int humi = dht.readHumidity();
-  int temp_C = dht.readTemperature();
-
-  if (temp_C < 200)
-    sensor_values.temperature = temp_C;
-  if (humi < 200)
-    sensor_values.humidity = humi;
-}
-
-void get_pm()
-{
-  int index = 0;
-  char value;
-  char previousValue;
-
-  while (softwareSerial.available())
-  {
-    value = softwareSerial.read();
-    if ((index == 0 && value != 0x42) || (index == 1 && value != 0x4d))
-    {
-      Serial.println("Cannot find the data header.");
-      break;
-    }
-
-    if (index > 3 && index % 2 == 0)
-    {
-      previousValue = value;
-    }
-    else if (index == 5)
-    {
-      sensor_values.pm1 = 256 * previousValue + value;
-    }
-    else if (index == 7)
-    {
-      sensor_values.pm2_5 = 256 * previousValue + value;
-    }
-    else if (index == 9)
-    {
-      sensor_values.pm10 = 256 * previousValue + value;
-    }
-    else if (index > 15)
-    {
-      break;
-    }
-
-    index++;
-  }
-  while (softwareSerial.available())
-    softwareSerial.read();
-}
-
 void display_temperature(int row, int col)
 {
-  LCD.setCursor(row, col);
-  LCD.write(4);
-  if (sensor_values.temperature < 10)
+  int temperature = quantity_value("temperature");
+  write_glyph(GLYPH_THERMOMETER, row, col);
+  if (temperature < 10)
   {
     LCD.print("0");
   }
-  LCD.print(sensor_values.temperature);
+  LCD.print(temperature);
   LCD.print((char)223);
   LCD.print("C");
 }
 
 void display_humidity(int row, int col)
 {
-  LCD.setCursor(row, col);
-  LCD.write(6);
-  if (sensor_values.humidity < 10)
-  {
-    LCD.print("0");
-  }
-  LCD.print(sensor_values.humidity);
+  write_glyph(GLYPH_WATER_DROPLET, row, col);
+  display_position(quantity_value("humidity"));
   LCD.print("%");
 }
 
@@ -937,32 +5194,82 @@ void display_pm_2_5(int col)
 {
   LCD.setCursor(0, col);
   LCD.print("Dust: ");
-  LCD.print(sensor_values.pm2_5);
-  LCD.setCursor(11, col);
-  LCD.write(7);
+  LCD.print(quantity_value("pm2_5"));
+  write_glyph(GLYPH_MU, 11, col);
   LCD.print("g/m");
-  LCD.write(8);
+  write_glyph(GLYPH_POWER_THREE, 15, col);
+}
+
+void display_aqi(int row)
+{
+  char line[17];
+  int aqi = sensor_aqi;
+  if (aqi < 0)
+    snprintf(line, sizeof(line), "AQI -- waiting  ");
+  else
+    snprintf(line, sizeof(line), "AQI%3d %-9s", aqi, aqi_categories[aqi_category(aqi)][0]);
+  LCD.setCursor(0, row);
+  LCD.print(line);
 }
 
-void display_menu(String menu)
+void display_menu(STATES menu)
 {
+  int screen = 0;
+  while (screen < MENU_SCREEN_COUNT - 1 && MENU_SCREENS[screen].state != menu)
+    screen++;
+
   LCD.setCursor(6, 0);
   LCD.print("MENU");
   LCD.setCursor(4, 1);
-  LCD.print(menu);
+  LCD.print(MENU_SCREENS[screen].title);
 
-  if (!menu.equalsIgnoreCase("SET TIME"))
+  if (screen > 0)
   {
-    LCD.setCursor(0, 1);
-    LCD.write(2);
+    write_glyph(GLYPH_MENU_LEFT_ARROW, 0, 1);
+  }
+  if (screen < MENU_SCREEN_COUNT - 1)
+  {
+    write_glyph(GLYPH_MENU_RIGHT_ARROW, 15, 1);
   }
-  if (!menu.equalsIgnoreCase("SET ALARM"))
+}
+
+void display_big_digit(int digit, int col)
+{
+  for (int row = 0; row < 2; row++)
   {
-    LCD.setCursor(15, 1);
-    LCD.write(3);
+    uint8_t chars[3];
+    for (int i = 0; i < 3; i++)
+    {
+      uint8_t part = BIG_DIGITS[digit][row][i];
+      if (part == BIG_BLANK)
+        chars[i] = ' ';
+      else if (part == BIG_FULL)
+        chars[i] = 0xff;
+      else
+        chars[i] = glyph_slot((GLYPHS)part);
+    }
+
+    LCD.setCursor(col, row);
+    for (int i = 0; i < 3; i++)
+      LCD.write(chars[i]);
   }
 }
 
+void display_big_time()
+{
+  get_time();
+  display_big_digit(clock_settings.time.hour / 10, 0);
+  display_big_digit(clock_settings.time.hour % 10, 3);
+  LCD.setCursor(6, 0);
+  LCD.write(0xa5); // centred dot
+  LCD.setCursor(6, 1);
+  LCD.write(0xa5);
+  display_big_digit(clock_settings.time.minute / 10, 7);
+  display_big_digit(clock_settings.time.minute % 10, 10);
+  LCD.setCursor(14, 1);
+  display_position(clock_settings.time.second);
+}
+
 void display_alarm()
 {
   LCD.setCursor(5, 0);
@@ -1006,66 +5313,44 @@ void on_exit()
 */
 void on_main_enter()
 {
-  state = MAIN;
-  LCD.setCursor(6, 0);
-  LCD.print("A");
-  // LCD.write(5);
-  LCD.setCursor(7, 0);
-  LCD.print("L");
-  // LCD.write(6);
-  LCD.setCursor(8, 0);
-  LCD.print("C");
-  // LCD.write(7);
-  LCD.setCursor(9, 0);
-  LCD.write(5);
-  LCD.setCursor(1, 1);
-  LCD.print("ESP32 & DS3231");
-  vTaskDelay(1200 / portTICK_PERIOD_MS);
-  LCD.clear();
+  enter_state(MAIN);
 }
 
 void main_on_state()
 {
-  get_pm();
+  sample_sensors(false);
   get_alarm();
-  get_temperature_humidity();
-  display_time(0, 0);
-  display_date(8, 1);
-  display_date_of_week(0, 1);
-  display_temperature(11, 0);
-
-  if (alarm_isr_was_called)
+  if (tz_offset(clock_now()) != alarm_offset_s)
+    program_alarm();
+  if (big_clock_face)
   {
-    if (RTC.alarm(DS3232RTC::ALARM_1))
-    {
-      LCD.clear();
-
-      for (int i = 0; i < 25; i++)
-      {
-        buttonOK.read();
-        if (buttonOK.wasPressed())
-        {
-          alarm_isr_was_called = false;
-          break;
-        }
-        beep();
-      }
-    }
-    LCD.clear();
+    display_big_time();
   }
+  else
+  {
+    display_alarm_indicator(4, 1);
+    display_time(0, 0);
+    display_date(8, 1);
+    display_date_of_week(0, 1);
+    display_temperature(11, 0);
+  }
+  record_first_frame();
 
   check_button();
+  // Holding UP would flip the face back and forth with every repeat
+  if ((button == BUTTON_UP || button == BUTTON_DOWN) && !button_repeated)
+  {
+    big_clock_face = !big_clock_face;
+    LCD.clear();
+  }
   transition(button);
 
   static unsigned long startAlertMillis = millis();
   // instant send notification
-  if (
-      (sensor_values.humidity >= 70 || sensor_values.temperature >= 35 || sensor_values.pm10 >= 150 || sensor_values.pm1 >= 75 || sensor_values.pm2_5 >= 75) && (millis() - startAlertMillis >= 900000))
+  if (sensor_alert() && (millis() - startAlertMillis >= 900000))
   {
     startAlertMillis = millis();
     xSemaphoreGive(sendReadySemaphore);
-    vTaskDelay(200 / portTICK_PERIOD_MS);
-    timerRestart(timer);
   }
 }
 
@@ -1074,7 +5359,7 @@ void main_on_state()
 */
 void on_display_alarm_time_enter()
 {
-  state = ALARM_TIME;
+  enter_state(ALARM_TIME);
 }
 
 void display_alarm_time_on_state()
@@ -1087,16 +5372,30 @@ void display_alarm_time_on_state()
 */
 void on_display_sensor_values_enter()
 {
-  state = SENSOR;
+  enter_state(SENSOR);
 }
 
 void display_sensor_values_on_state()
 {
-  get_pm();
-  get_temperature_humidity();
+  static unsigned long last_swap_ms = 0;
+  static bool show_aqi = false;
+
+  sample_sensors(true);
   display_temperature(3, 0);
   display_humidity(9, 0);
-  display_pm_2_5(1);
+
+  // The bottom row alternates between the PM2.5 reading and the AQI
+  if (millis() - last_swap_ms >= 3000)
+  {
+    last_swap_ms = millis();
+    show_aqi = !show_aqi;
+    LCD.setCursor(0, 1);
+    LCD.print("                ");
+  }
+  if (show_aqi)
+    display_aqi(1);
+  else
+    display_pm_2_5(1);
 
   check_button();
   transition(button);
@@ -1107,8 +5406,8 @@ void display_sensor_values_on_state()
 */
 void on_menu_set_time_enter()
 {
-  state = MENU_SET_TIME;
-  display_menu("Set Time");
+  enter_state(MENU_SET_TIME);
+  display_menu(MENU_SET_TIME);
 }
 
 void menu_set_time_on_state()
@@ -1122,7 +5421,7 @@ void menu_set_time_on_state()
 */
 void on_set_hour_enter()
 {
-  state = SET_HOUR;
+  enter_state(SET_HOUR);
   LCD.setCursor(4, 0);
   LCD.print("Set Time:");
 }
@@ -1144,7 +5443,7 @@ void set_hour_on_state()
 */
 void on_set_minute_enter()
 {
-  state = SET_MINUTE;
+  enter_state(SET_MINUTE);
   LCD.setCursor(4, 0);
   LCD.print("Set Time:");
 }
@@ -1167,8 +5466,8 @@ void set_minute_on_state()
 */
 void on_menu_set_date_enter()
 {
-  state = MENU_SET_DATE;
-  display_menu("Set Date");
+  enter_state(MENU_SET_DATE);
+  display_menu(MENU_SET_DATE);
 }
 
 void menu_set_date_on_state()
@@ -1182,7 +5481,7 @@ void menu_set_date_on_state()
 */
 void on_set_day_enter()
 {
-  state = SET_DAY;
+  enter_state(SET_DAY);
   LCD.setCursor(4, 0);
   LCD.print("Set Date:");
 }
@@ -1205,7 +5504,7 @@ void set_day_on_state()
 */
 void on_set_month_enter()
 {
-  state = SET_MONTH;
+  enter_state(SET_MONTH);
   LCD.setCursor(4, 0);
   LCD.print("Set Date:");
 }
@@ -1229,7 +5528,7 @@ void set_month_on_state()
 */
 void on_set_year_enter()
 {
-  state = SET_YEAR;
+  enter_state(SET_YEAR);
   LCD.setCursor(4, 0);
   LCD.print("Set Date:");
 }
@@ -1245,7 +5544,8 @@ void set_year_on_state()
   LCD.print("/");
   display_position(clock_settings.date.month);
   LCD.print("/");
-  blink(clock_settings.date.year, 10, 1);
+  display_position(clock_settings.date.year / 100);
+  blink(clock_settings.date.year % 100, 12, 1);
 }
 
 /*
@@ -1253,8 +5553,8 @@ void set_year_on_state()
 */
 void on_menu_set_alarm_enter()
 {
-  state = MENU_SET_ALARM;
-  display_menu("Set Alarm");
+  enter_state(MENU_SET_ALARM);
+  display_menu(MENU_SET_ALARM);
 }
 
 void menu_set_alarm_on_state()
@@ -1268,7 +5568,7 @@ void menu_set_alarm_on_state()
 */
 void on_set_alarm_hour_enter()
 {
-  state = SET_ALARM_HOUR;
+  enter_state(SET_ALARM_HOUR);
   LCD.setCursor(3, 0);
   LCD.print("Set Alarm:");
 }
@@ -1291,7 +5591,7 @@ void set_alarm_hour_on_state()
 */
 void on_set_alarm_minute_enter()
 {
-  state = SET_ALARM_MINUTE;
+  enter_state(SET_ALARM_MINUTE);
   LCD.setCursor(3, 0);
   LCD.print("Set Alarm:");
 }
@@ -1315,7 +5615,7 @@ void set_alarm_minute_on_state()
 */
 void on_set_alarm_on_off_enter()
 {
-  state = SET_ALARM_ON_OFF;
+  enter_state(SET_ALARM_ON_OFF);
   LCD.setCursor(3, 0);
   LCD.print("Set Alarm:");
 }
@@ -1331,67 +5631,41 @@ void set_alarm_on_off_on_state()
   LCD.print(":");
   display_position(clock_settings.alarm.minute);
   LCD.print("  ");
-  clock_settings.alarm.active ? blink("ON ", 12, 1) : blink("OFF", 12, 1);
+  blink(ON_OFF[clock_settings.alarm.active], 12, 1);
 }
 
 void check_button()
 {
   if (button != IDLE)
     button = IDLE;
+  button_repeated = false;
 
-  buttonLeft.read();
-  buttonRight.read();
-  buttonUp.read();
-  buttonDown.read();
-  buttonOK.read();
-  buttonBack.read();
-
-  if (buttonLeft.wasPressed())
-    button = BUTTON_LEFT;
-
-  if (buttonRight.wasPressed())
-    button = BUTTON_RIGHT;
-
-  if (buttonUp.wasPressed())
-    button = BUTTON_UP;
-
-  if (buttonDown.wasPressed())
-    button = BUTTON_DOWN;
-
-  if (buttonOK.wasPressed())
-    button = BUTTON_OK;
-
-  if (buttonBack.wasPressed())
-    button = BUTTON_BACK;
-
-  if (buttonUp.wasReleased())
-  {
-    long_press_button = false;
-    rpt = REPEAT_FIRST;
-  }
+  ButtonEvents events = read_button_events();
 
-  if (buttonUp.pressedFor(rpt))
+  // Same precedence as before: a later button in the list wins
+  for (int i = 0; i < BUTTON_COUNT; i++)
   {
-    rpt += REPEAT_INCR;
-    long_press_button = true;
-    button = BUTTON_UP;
+    if (events.pressed & (1 << i))
+      button = (BUTTONS)(i + 1);
   }
 
-  if (buttonDown.wasReleased())
+  for (int i = 0; i < BUTTON_COUNT; i++)
   {
-    long_press_button = false;
-    rpt = REPEAT_FIRST;
+    if (events.repeated & (1 << i))
+    {
+      button = (BUTTONS)(i + 1);
+      button_repeated = true;
+    }
   }
 
-  if (buttonDown.pressedFor(rpt))
-  {
-    rpt += REPEAT_INCR;
-    long_press_button = true;
-    button = BUTTON_DOWN;
-  }
+  long_press_button = (button_scanner.repeating & BUTTON_REPEAT_MASK) != 0;
 
   if (button != IDLE)
+  {
     not_AFK();
+    postmortem.last_button = button;
+    postmortem_record(EVENT_BUTTON, button);
+  }
 
   check_AFK();
   if (is_AFK)
@@ -1419,84 +5693,37 @@ void transition(BUTTONS trigger)
     fsm.trigger(trigger);
 }
 
-void update_clock_settings()
+CLOCK_FIELDS setting_field(STATES screen)
 {
-  if (button == BUTTON_UP)
-  {
-    reset_blink();
-    switch (state)
-    {
-    case SET_HOUR:
-      increase(clock_settings.time.hour, 23, 0);
-      break;
-    case SET_MINUTE:
-      increase(clock_settings.time.minute, 59, 0);
-      break;
-    case SET_DAY:
-      increase(clock_settings.date.day, 31, 1);
-      break;
-    case SET_MONTH:
-      increase(clock_settings.date.month, 12, 1);
-      break;
-    case SET_YEAR:
-      increase(clock_settings.date.year, 99, 0);
-      break;
-    case SET_ALARM_HOUR:
-      increase(clock_settings.alarm.hour, 23, 0);
-      break;
-    case SET_ALARM_MINUTE:
-      increase(clock_settings.alarm.minute, 59, 0);
-      break;
-    case SET_ALARM_ON_OFF:
-      clock_settings.alarm.active = !clock_settings.alarm.active;
-      break;
-    }
-  }
-  else if (button == BUTTON_DOWN)
+  switch (screen)
   {
-    reset_blink();
-    switch (state)
-    {
-    case SET_HOUR:
-      decrease(clock_settings.time.hour, 23, 0);
-      break;
-    case SET_MINUTE:
-      decrease(clock_settings.time.minute, 59, 0);
-      break;
-    case SET_DAY:
-      decrease(clock_settings.date.day, 31, 1);
-      break;
-    case SET_MONTH:
-      decrease(clock_settings.date.month, 12, 1);
-      break;
-    case SET_YEAR:
-      decrease(clock_settings.date.year, 99, 0);
-      break;
-    case SET_ALARM_HOUR:
-      decrease(clock_settings.alarm.hour, 23, 0);
-      break;
-    case SET_ALARM_MINUTE:
-      decrease(clock_settings.alarm.minute, 59, 0);
-      break;
-    case SET_ALARM_ON_OFF:
-      clock_settings.alarm.active = !clock_settings.alarm.active;
-      break;
-    }
+  case SET_HOUR:
+    return FIELD_HOUR;
+  case SET_MINUTE:
+    return FIELD_MINUTE;
+  case SET_DAY:
+    return FIELD_DAY;
+  case SET_MONTH:
+    return FIELD_MONTH;
+  case SET_YEAR:
+    return FIELD_YEAR;
+  case SET_ALARM_HOUR:
+    return FIELD_ALARM_HOUR;
+  case SET_ALARM_MINUTE:
+    return FIELD_ALARM_MINUTE;
+  case SET_ALARM_ON_OFF:
+    return FIELD_ALARM_ON_OFF;
+  default:
+    return FIELD_NONE;
   }
 }
 
-void increase(int &number, int max, int min)
-{
-  number++;
-  if (number > max)
-    number = min;
-}
-
-void decrease(int &number, int max, int min)
+void update_clock_settings()
 {
-  number--;
-  if (number < min)
-    number = max;
+  if (button != BUTTON_UP && button != BUTTON_DOWN)
+    return;
+  reset_blink();
+  adjust_clock_setting(clock_settings, setting_field(state), button == BUTTON_UP);
 }
 
 void blink_millis()
@@ -1539,7 +5766,7 @@ void blink(int value, int col, int row)
   }
 }
 
-void blink(String value, int col, int row)
+void blink(const char *value, int col, int row)
 {
   blink_millis();
   if (!blink_state)
@@ -1560,34 +5787,10 @@ void reset_blink()
   blink_previous_millis = millis();
 }
 
-void beep()
-{
-  digitalWrite(ALARM_OUT, HIGH);
-  LCD.noBacklight();
-  vTaskDelay(500 / portTICK_PERIOD_MS);
-  digitalWrite(ALARM_OUT, LOW);
-  LCD.backlight();
-  vTaskDelay(500 / portTICK_PERIOD_MS);
-}
-
-byte dec2bcd(byte val)
-{
-  return ((val / 10 * 16) + (val % 10));
-}
-
-byte bcd2dec(byte val)
-{
-  return ((val / 16 * 10) + (val % 16));
-}
-
 void display_position(int digits)
 {
-  if (digits < 10)
-    LCD.print("0");
-  LCD.print(digits);
+  char text[NUMBER_TEXT_SIZE];
+  LCD.print(format_number(text, digits, 2));
 }
 
-void alarm_isr()
-{
-  alarm_isr_was_called = true;
-}
+
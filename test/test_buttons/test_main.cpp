@@ -0,0 +1,149 @@
+#include <unity.h>
+#include "buttons.h"
+
+#define UP (1 << 2)
+#define DOWN (1 << 3)
+#define OK (1 << 4)
+
+ButtonScanner scanner;
+
+void setUp()
+{
+  button_scanner_init(scanner, UP | DOWN);
+}
+
+void tearDown() {}
+
+// Feeds the same raw sample for scans scans and returns the events they caused
+ButtonEvents scan(uint8_t raw, int scans)
+{
+  ButtonEvents events = {0, 0, 0, 0};
+  for (int i = 0; i < scans; i++)
+    button_scan(scanner, raw, events);
+  return events;
+}
+
+void test_press_after_four_equal_scans()
+{
+  TEST_ASSERT_EQUAL(0, scan(OK, 3).pressed);
+  ButtonEvents events = scan(OK, 1);
+  TEST_ASSERT_EQUAL(OK, events.pressed);
+  TEST_ASSERT_EQUAL(OK, scanner.state);
+  TEST_ASSERT_EQUAL(0, scan(OK, 10).pressed); // one press, not one per scan
+}
+
+void test_bounce_is_ignored()
+{
+  ButtonEvents events = {0, 0, 0, 0};
+  for (int i = 0; i < 40; i++)
+    button_scan(scanner, i % 3 ? OK : 0, events); // never 4 in a row
+  TEST_ASSERT_EQUAL(0, events.pressed);
+  TEST_ASSERT_EQUAL(0, scanner.state);
+
+  scan(OK, 4);
+  events = {0, 0, 0, 0};
+  for (int i = 0; i < 40; i++)
+    button_scan(scanner, i % 3 ? 0 : OK, events); // contact chatter while held
+  TEST_ASSERT_EQUAL(0, events.released);
+  TEST_ASSERT_EQUAL(OK, scanner.state);
+}
+
+void test_release_after_four_equal_scans()
+{
+  scan(OK, 4);
+  TEST_ASSERT_EQUAL(0, scan(0, 3).released);
+  ButtonEvents events = scan(0, 1);
+  TEST_ASSERT_EQUAL(OK, events.released);
+  TEST_ASSERT_EQUAL(0, events.pressed);
+  TEST_ASSERT_EQUAL(0, scanner.state);
+}
+
+void test_buttons_debounce_independently()
+{
+  scan(UP, 2);
+  ButtonEvents events = scan(UP | OK, 2);
+  TEST_ASSERT_EQUAL(UP, events.pressed);
+  events = scan(UP | OK, 2);
+  TEST_ASSERT_EQUAL(OK, events.pressed);
+}
+
+void test_hold_gives_one_long_press()
+{
+  // The press lands on scan 4, so the hold counts from there
+  ButtonEvents events = scan(OK, 3 + MS_TO_SCANS(LONG_PRESS_MS) - 1);
+  TEST_ASSERT_EQUAL(0, events.long_pressed);
+  TEST_ASSERT_EQUAL(OK, scan(OK, 1).long_pressed);
+  TEST_ASSERT_EQUAL(0, scan(OK, 2 * MS_TO_SCANS(LONG_PRESS_MS)).long_pressed);
+}
+
+void test_hold_repeats_only_repeating_buttons()
+{
+  ButtonEvents events = scan(OK, 4 + 2 * MS_TO_SCANS(REPEAT_FIRST));
+  TEST_ASSERT_EQUAL(0, events.repeated);
+  TEST_ASSERT_EQUAL(0, scanner.repeating);
+}
+
+void test_hold_repeat_schedule()
+{
+  scan(UP, 4); // pressed, held for 1 scan
+  int repeats = 0;
+  int first = -1;
+  for (int i = 2; i <= MS_TO_SCANS(REPEAT_FIRST) + 4 * MS_TO_SCANS(REPEAT_INCR); i++)
+  {
+    if (scan(UP, 1).repeated & UP)
+    {
+      if (first < 0)
+        first = i;
+      repeats++;
+    }
+  }
+  TEST_ASSERT_EQUAL(MS_TO_SCANS(REPEAT_FIRST), first);
+  TEST_ASSERT_EQUAL(5, repeats);
+  TEST_ASSERT_EQUAL(UP, scanner.repeating);
+}
+
+void test_release_resets_repeat()
+{
+  scan(UP, 4 + MS_TO_SCANS(REPEAT_FIRST));
+  TEST_ASSERT_EQUAL(UP, scanner.repeating);
+
+  ButtonEvents events = scan(0, 4);
+  TEST_ASSERT_EQUAL(UP, events.released);
+  TEST_ASSERT_EQUAL(0, scanner.repeating);
+
+  // The next hold waits the full first delay again
+  TEST_ASSERT_EQUAL(0, scan(UP, 3 + MS_TO_SCANS(REPEAT_FIRST) - 1).repeated);
+  TEST_ASSERT_EQUAL(UP, scan(UP, 1).repeated);
+}
+
+void test_repeat_state_is_per_button()
+{
+  scan(UP, 4 + MS_TO_SCANS(REPEAT_FIRST) / 2);
+  scan(UP | DOWN, 4); // DOWN joins halfway through UP's first delay
+
+  int up = 0, down = 0;
+  for (int i = 0; i < MS_TO_SCANS(REPEAT_FIRST) / 2; i++)
+  {
+    ButtonEvents events = scan(UP | DOWN, 1);
+    up += (events.repeated & UP) != 0;
+    down += (events.repeated & DOWN) != 0;
+  }
+  TEST_ASSERT_EQUAL(1, up);
+  TEST_ASSERT_EQUAL(0, down);
+  TEST_ASSERT_EQUAL(UP, scanner.repeating);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_press_after_four_equal_scans);
+  RUN_TEST(test_bounce_is_ignored);
+  RUN_TEST(test_release_after_four_equal_scans);
+  RUN_TEST(test_buttons_debounce_independently);
+  RUN_TEST(test_hold_gives_one_long_press);
+  RUN_TEST(test_hold_repeats_only_repeating_buttons);
+  RUN_TEST(test_hold_repeat_schedule);
+  RUN_TEST(test_release_resets_repeat);
+  RUN_TEST(test_repeat_state_is_per_button);
+  return UNITY_END();
+}
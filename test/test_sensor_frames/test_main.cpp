@@ -0,0 +1,128 @@
+#include <unity.h>
+#include "dht22.h"
+#include "pms7003.h"
+
+// High times the DHT22 would send for these 5 bytes, after the given
+// number of extra pulses in front (the release and the response)
+int dht22_pulses(const uint8_t *bytes, int lead, uint16_t *high_us)
+{
+  int count = 0;
+  for (int i = 0; i < lead; i++)
+    high_us[count++] = 80;
+  for (int i = 0; i < DHT22_BITS; i++)
+    high_us[count++] = bytes[i / 8] & (0x80 >> (i % 8)) ? 70 : 27;
+  return count;
+}
+
+int reading(const SensorRecord &record, uint8_t quantity)
+{
+  for (int i = 0; i < record.count; i++)
+  {
+    if (record.readings[i].quantity == quantity)
+      return record.readings[i].value;
+  }
+  TEST_FAIL_MESSAGE("quantity not recorded");
+  return 0;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_dht22_decodes_humidity_and_temperature()
+{
+  // 65.2 % and 35.1 degrees
+  uint8_t bytes[5] = {0x02, 0x8c, 0x01, 0x5f, 0xee};
+  uint16_t high_us[DHT22_BITS + 2];
+  SensorRecord record = {};
+  TEST_ASSERT_TRUE(dht22_decode(high_us, dht22_pulses(bytes, 2, high_us), record));
+  TEST_ASSERT_EQUAL(2, record.count);
+  TEST_ASSERT_EQUAL(65, reading(record, DHT22_HUMIDITY));
+  TEST_ASSERT_EQUAL(35, reading(record, DHT22_TEMPERATURE));
+}
+
+void test_dht22_negative_temperature()
+{
+  // -10.1 degrees
+  uint8_t bytes[5] = {0x01, 0xf4, 0x80, 0x65, 0x00};
+  bytes[4] = bytes[0] + bytes[1] + bytes[2] + bytes[3];
+  uint16_t high_us[DHT22_BITS];
+  SensorRecord record = {};
+  TEST_ASSERT_TRUE(dht22_decode(high_us, dht22_pulses(bytes, 0, high_us), record));
+  TEST_ASSERT_EQUAL(-10, reading(record, DHT22_TEMPERATURE));
+}
+
+void test_dht22_rejects_bad_checksum()
+{
+  uint8_t bytes[5] = {0x02, 0x8c, 0x01, 0x5f, 0xef};
+  uint16_t high_us[DHT22_BITS];
+  SensorRecord record = {};
+  TEST_ASSERT_FALSE(dht22_decode(high_us, dht22_pulses(bytes, 0, high_us), record));
+  TEST_ASSERT_EQUAL(0, record.count);
+}
+
+void test_dht22_rejects_short_read()
+{
+  uint8_t bytes[5] = {0x02, 0x8c, 0x01, 0x5f, 0xee};
+  uint16_t high_us[DHT22_BITS];
+  SensorRecord record = {};
+  dht22_pulses(bytes, 0, high_us);
+  TEST_ASSERT_FALSE(dht22_decode(high_us, DHT22_BITS - 1, record));
+}
+
+void test_pms_frame_readings_and_checksum()
+{
+  uint8_t frame[PM_FRAME_LENGTH] = {0x42, 0x4d, 0x00, 0x1c, 0x00, 0x0c, 0x00, 0x12, 0x00, 0x17};
+  uint16_t sum = 0;
+  for (int i = 0; i < PM_FRAME_LENGTH - 2; i++)
+    sum += frame[i];
+  frame[PM_FRAME_LENGTH - 2] = sum >> 8;
+  frame[PM_FRAME_LENGTH - 1] = sum & 0xff;
+  TEST_ASSERT_TRUE(pm_frame_checksum_ok(frame));
+
+  SensorRecord record = {};
+  TEST_ASSERT_TRUE(parse_pm_frame(frame, PM_FRAME_LENGTH, record));
+  TEST_ASSERT_EQUAL(12, reading(record, PMS_PM1));
+  TEST_ASSERT_EQUAL(18, reading(record, PMS_PM2_5));
+  TEST_ASSERT_EQUAL(23, reading(record, PMS_PM10));
+
+  frame[7]++;
+  TEST_ASSERT_FALSE(pm_frame_checksum_ok(frame));
+}
+
+void test_pms_rejects_missing_header()
+{
+  uint8_t frame[PM_FRAME_PREFIX] = {0x4d, 0x42};
+  SensorRecord record = {};
+  TEST_ASSERT_FALSE(parse_pm_frame(frame, PM_FRAME_PREFIX, record));
+  TEST_ASSERT_EQUAL(0, record.count);
+}
+
+// The sleep, wake and passive mode commands from the datasheet
+void test_pms_commands()
+{
+  const uint8_t sleep[PM_COMMAND_LENGTH] = {0x42, 0x4d, 0xe4, 0x00, 0x00, 0x01, 0x73};
+  const uint8_t wake[PM_COMMAND_LENGTH] = {0x42, 0x4d, 0xe4, 0x00, 0x01, 0x01, 0x74};
+  const uint8_t passive[PM_COMMAND_LENGTH] = {0x42, 0x4d, 0xe1, 0x00, 0x00, 0x01, 0x70};
+  uint8_t command[PM_COMMAND_LENGTH];
+
+  pm_command(PMS_CMD_SLEEP, 0, command);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(sleep, command, PM_COMMAND_LENGTH);
+  pm_command(PMS_CMD_SLEEP, 1, command);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(wake, command, PM_COMMAND_LENGTH);
+  pm_command(PMS_CMD_MODE, 0, command);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(passive, command, PM_COMMAND_LENGTH);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_dht22_decodes_humidity_and_temperature);
+  RUN_TEST(test_dht22_negative_temperature);
+  RUN_TEST(test_dht22_rejects_bad_checksum);
+  RUN_TEST(test_dht22_rejects_short_read);
+  RUN_TEST(test_pms_frame_readings_and_checksum);
+  RUN_TEST(test_pms_rejects_missing_header);
+  RUN_TEST(test_pms_commands);
+  return UNITY_END();
+}
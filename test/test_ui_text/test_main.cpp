@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <unity.h>
+#include "ui_text.h"
+
+// Counts every heap allocation in this process. glibc's own entry points
+// still do the work, so the test runs normally.
+extern "C"
+{
+  void *__libc_malloc(size_t size);
+  void *__libc_calloc(size_t count, size_t size);
+  void *__libc_realloc(void *ptr, size_t size);
+}
+
+static volatile unsigned allocations = 0;
+
+extern "C" void *malloc(size_t size)
+{
+  allocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+void *operator new(size_t size)
+{
+  allocations++;
+  void *ptr = __libc_malloc(size ? size : 1);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_pads_to_two_digits()
+{
+  char text[NUMBER_TEXT_SIZE];
+  TEST_ASSERT_EQUAL_STRING("00", format_number(text, 0, 2));
+  TEST_ASSERT_EQUAL_STRING("07", format_number(text, 7, 2));
+  TEST_ASSERT_EQUAL_STRING("59", format_number(text, 59, 2));
+}
+
+void test_keeps_every_digit()
+{
+  char text[NUMBER_TEXT_SIZE];
+  TEST_ASSERT_EQUAL_STRING("100", format_number(text, 100, 2));
+  TEST_ASSERT_EQUAL_STRING("2026", format_number(text, 2026, 2));
+  TEST_ASSERT_EQUAL_STRING("2147483647", format_number(text, 2147483647, 2));
+}
+
+void test_negative_numbers()
+{
+  char text[NUMBER_TEXT_SIZE];
+  TEST_ASSERT_EQUAL_STRING("-05", format_number(text, -5, 2));
+  TEST_ASSERT_EQUAL_STRING("-2147483648", format_number(text, INT32_MIN, 2));
+}
+
+void test_day_names()
+{
+  TEST_ASSERT_EQUAL_STRING("Sun", day_name(1));
+  TEST_ASSERT_EQUAL_STRING("Sat", day_name(7));
+  TEST_ASSERT_EQUAL_STRING("???", day_name(0));
+  TEST_ASSERT_EQUAL_STRING("???", day_name(8));
+}
+
+void test_formatting_does_not_allocate()
+{
+  char text[NUMBER_TEXT_SIZE];
+  size_t length = 0;
+  unsigned before = allocations;
+  for (int32_t value = -1000; value <= 10000; value++)
+    length += strlen(format_number(text, value, 2));
+  for (int day = 0; day <= 8; day++)
+    length += strlen(day_name(day)) + strlen(ON_OFF[day & 1]);
+  unsigned made = allocations - before;
+
+  TEST_ASSERT_GREATER_THAN(0, length);
+  TEST_ASSERT_EQUAL(0, made);
+}
+
+void test_allocations_are_counted()
+{
+  unsigned before = allocations;
+  void *volatile ptr = malloc(16); // volatile, or the pair is optimised away
+  free(ptr);
+  TEST_ASSERT_EQUAL(1, allocations - before); // or the test above proves nothing
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_pads_to_two_digits);
+  RUN_TEST(test_keeps_every_digit);
+  RUN_TEST(test_negative_numbers);
+  RUN_TEST(test_day_names);
+  RUN_TEST(test_formatting_does_not_allocate);
+  RUN_TEST(test_allocations_are_counted);
+  return UNITY_END();
+}
@@ -0,0 +1,277 @@
+/*
+   Micro-benchmarks for the firmware's hot paths, run on the host.
+
+   Build (arduino-fsm comes from the firmware's libdeps, so run pio run once first):
+     g++ -O2 -std=c++17 -DARDUINO=100 -Iinclude -Itools/host -I.pio/libdeps/esp32dev/arduino-fsm \
+         tools/bench.cpp .pio/libdeps/esp32dev/arduino-fsm/Fsm.cpp -o bench
+   Usage:  ./bench [--filter TEXT] [--runs N] [--batch-ms MS]
+
+     --filter TEXT   only benchmarks whose name contains TEXT
+     --runs N        timed batches per benchmark (11)
+     --batch-ms MS   target length of one batch (20)
+
+   Every benchmark calls the same code the firmware runs: the helpers in
+   include/ and the arduino-fsm library, with a state machine of the same
+   shape as the clock's. Each result is one JSON line:
+
+     BENCH {"name":"bcd2dec","ops":4194304,"ns_per_op":0.9,"min_ns_per_op":0.9,"allocs_per_op":0.00}
+
+   ns_per_op is the median over the batches and min_ns_per_op the fastest,
+   so a noisy machine moves the first and rarely the second. allocs_per_op
+   counts every malloc, calloc, realloc and new; anything above 0 is a
+   regression for code that runs every tick. Compare the lines of two
+   builds to see what changed, and run on an idle machine with a fixed CPU
+   frequency when the numbers matter.
+*/
+#include <algorithm>
+#include <new>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include <Fsm.h>
+
+#include "../include/clock_settings.h"
+#include "../include/pms7003.h"
+#include "../include/publish.h"
+#include "../include/ui_text.h"
+
+struct Options
+{
+  const char *filter = "";
+  int runs = 11;
+  double batch_ms = 20;
+} options;
+
+/*
+   Allocation counting
+
+   glibc's own entry points do the work, so counting costs one increment.
+*/
+extern "C"
+{
+  void *__libc_malloc(size_t size);
+  void *__libc_calloc(size_t count, size_t size);
+  void *__libc_realloc(void *ptr, size_t size);
+}
+
+static uint64_t allocations = 0;
+
+extern "C" void *malloc(size_t size)
+{
+  allocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+void *operator new(size_t size)
+{
+  allocations++;
+  void *ptr = __libc_malloc(size ? size : 1);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+/*
+   Runner
+*/
+int64_t now_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Keeps the compiler from dropping a result it can see is unused
+template <typename T>
+inline void keep(const T &value)
+{
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+int64_t time_batch(uint32_t ops, void (*body)(uint32_t i))
+{
+  int64_t start = now_ns();
+  for (uint32_t i = 0; i < ops; i++)
+    body(i);
+  return now_ns() - start;
+}
+
+void run_benchmark(const char *name, void (*body)(uint32_t i))
+{
+  if (!strstr(name, options.filter))
+    return;
+
+  // Double the batch until it is long enough to time, which also warms up
+  uint32_t ops = 1024;
+  while (ops < (1u << 30) && time_batch(ops, body) < options.batch_ms * 1e6)
+    ops *= 2;
+
+  std::vector<double> ns_per_op;
+  uint64_t allocated = 0;
+  for (int run = 0; run < options.runs; run++)
+  {
+    uint64_t before = allocations;
+    int64_t ns = time_batch(ops, body);
+    allocated += allocations - before;
+    ns_per_op.push_back((double)ns / ops);
+  }
+  std::sort(ns_per_op.begin(), ns_per_op.end());
+
+  printf("BENCH {\"name\":\"%s\",\"ops\":%u,\"ns_per_op\":%.1f,\"min_ns_per_op\":%.1f,\"allocs_per_op\":%.2f}\n",
+         name, ops, ns_per_op[ns_per_op.size() / 2], ns_per_op[0], (double)allocated / ops / options.runs);
+  fflush(stdout);
+}
+
+/*
+   State machine of the clock's shape: a main screen, three display screens,
+   three menus and eight set screens, with the button transitions between
+   them and a way back to the main screen from everywhere.
+*/
+enum Events
+{
+  EVENT_LEFT = 1,
+  EVENT_RIGHT,
+  EVENT_UP,
+  EVENT_DOWN,
+  EVENT_OK,
+  EVENT_BACK,
+  EVENT_ALARM_DISMISSED,
+  EVENT_UNUSED = 0x7fff, // no transition uses it
+};
+
+#define FSM_STATES 15
+
+uint32_t fsm_entries;
+
+void on_enter()
+{
+  fsm_entries++;
+}
+
+State fsm_states[FSM_STATES] = {
+    State(on_enter, NULL, NULL), State(on_enter, NULL, NULL), State(on_enter, NULL, NULL),
+    State(on_enter, NULL, NULL), State(on_enter, NULL, NULL), State(on_enter, NULL, NULL),
+    State(on_enter, NULL, NULL), State(on_enter, NULL, NULL), State(on_enter, NULL, NULL),
+    State(on_enter, NULL, NULL), State(on_enter, NULL, NULL), State(on_enter, NULL, NULL),
+    State(on_enter, NULL, NULL), State(on_enter, NULL, NULL), State(on_enter, NULL, NULL)};
+Fsm fsm(&fsm_states[0]);
+
+void fsm_begin()
+{
+  for (int i = 0; i < FSM_STATES; i++)
+  {
+    State *next = &fsm_states[(i + 1) % FSM_STATES];
+    fsm.add_transition(&fsm_states[i], next, EVENT_RIGHT, NULL);
+    fsm.add_transition(next, &fsm_states[i], EVENT_LEFT, NULL);
+    if (i)
+      fsm.add_transition(&fsm_states[i], &fsm_states[0], EVENT_ALARM_DISMISSED, NULL);
+  }
+  fsm.run_machine(); // triggers are ignored until the first tick
+}
+
+/*
+   Benchmarks
+*/
+const uint8_t pm_frame[PM_FRAME_PREFIX] = {0x42, 0x4d, 0x00, 0x1c, 0x00, 0x0c, 0x00, 0x12,
+                                           0x00, 0x17, 0x00, 0x0c, 0x00, 0x12, 0x00, 0x17};
+ClockSettings clock_settings = {{12, 30, 0}, {19, 10, 2026}, {7, 0, true}};
+
+void parse_options(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const char *name = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!value)
+    {
+      fprintf(stderr, "missing value for %s\n", name);
+      exit(2);
+    }
+    i++;
+
+    if (!strcmp(name, "--filter"))
+      options.filter = value;
+    else if (!strcmp(name, "--runs"))
+      options.runs = std::max(1, atoi(value));
+    else if (!strcmp(name, "--batch-ms"))
+      options.batch_ms = atof(value);
+    else
+    {
+      fprintf(stderr, "unknown option %s, see the comment at the top of tools/bench.cpp\n", name);
+      exit(2);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  parse_options(argc, argv);
+  fsm_begin();
+
+  run_benchmark("bcd2dec", [](uint32_t i) { keep(bcd2dec(i & 0x7f)); });
+  run_benchmark("dec2bcd", [](uint32_t i) { keep(dec2bcd(i % 100)); });
+
+  run_benchmark("parse_pm_frame", [](uint32_t i) {
+    SensorRecord record = {};
+    record.ms = i;
+    keep(pm_frame); // reload the frame every time, as a fresh read would
+    keep(parse_pm_frame(pm_frame, PM_FRAME_PREFIX, record));
+    keep(record);
+  });
+
+  run_benchmark("mqtt_payload", [](uint32_t i) {
+    char payload[PUBLISH_PAYLOAD_SIZE];
+    PublishReadings readings = {55, 31, (int)(i % 40), (int)(i % 60), (int)(i % 90), 87, 87, 42, "Moderate"};
+    keep(format_sensor_payload(payload, sizeof(payload), readings));
+    keep(payload);
+  });
+  run_benchmark("mqtt_payload_no_aqi", [](uint32_t i) {
+    char payload[PUBLISH_PAYLOAD_SIZE];
+    PublishReadings readings = {55, 31, (int)(i % 40), (int)(i % 60), (int)(i % 90), -1, 0, 0, ""};
+    keep(format_sensor_payload(payload, sizeof(payload), readings));
+    keep(payload);
+  });
+
+  run_benchmark("fsm_trigger_unmatched", [](uint32_t) { fsm.trigger(EVENT_UNUSED); });
+  run_benchmark("fsm_trigger_transition", [](uint32_t i) { fsm.trigger(i & 1 ? EVENT_LEFT : EVENT_RIGHT); });
+  keep(fsm_entries);
+
+  run_benchmark("update_clock_settings", [](uint32_t i) {
+    adjust_clock_setting(clock_settings, (CLOCK_FIELDS)(FIELD_HOUR + i % 8), i & 1);
+    keep(clock_settings);
+  });
+
+  run_benchmark("display_position", [](uint32_t i) {
+    char text[NUMBER_TEXT_SIZE];
+    keep(format_number(text, i % 100, 2));
+    keep(text);
+  });
+  run_benchmark("display_position_year", [](uint32_t i) {
+    char text[NUMBER_TEXT_SIZE];
+    keep(format_number(text, CLOCK_FIRST_YEAR + i % 100, 2));
+    keep(text);
+  });
+  run_benchmark("day_name", [](uint32_t i) { keep(day_name(i & 7)); });
+  return 0;
+}
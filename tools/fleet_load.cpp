@@ -0,0 +1,732 @@
+/*
+   Fleet load generator for the MQTT broker the clocks publish to.
+
+   Build:  g++ -O2 -std=c++17 -Iinclude tools/fleet_load.cpp -o fleet_load
+   Usage:  ./fleet_load [options]
+
+     --host H          broker address (127.0.0.1)
+     --port N          broker port (1883)
+     --devices N       virtual clocks (1000)
+     --duration S      run time in seconds (300)
+     --interval S      sensor publish interval (PUBLISH_INTERVAL_S)
+     --keep-alive S    keep-alive publish interval (KEEP_ALIVE_INTERVAL_S)
+     --schedule M      sensor publishes on the firmware's wall-clock grid (aligned),
+                       or every jittered interval from connect (boot), as before
+     --jitter F        every boot-schedule and keep-alive interval is scaled by
+                       1 +- F at random (0.1)
+     --connect-rate N  new connections per second at start-up (500)
+     --storm-every S   every S seconds, drop and reconnect part of the fleet (0, off)
+     --storm-share F   share of the fleet in each storm (0.5)
+     --channel N       channel ID of the first device, the rest count up (900000)
+     --user U, --password P
+     --report S        seconds between progress lines (10)
+
+   Every device behaves like send_mqtt_task and keep_alive_task. It connects
+   with its own client ID and subscribes to its command topic. It publishes a
+   keep-alive payload right away and then on its own interval. Sensor
+   payloads go out on the slots publish_slot_after() gives its client ID, as
+   on a clock, or with --schedule boot right away and then every interval. It sends PINGREQ when idle for MQTT_KEEP_ALIVE_S and retries a
+   failed connection after MQTT_RETRY_MS. Payloads and topics come from
+   include/publish.h, the same code the firmware runs. A device in a storm
+   reconnects straight away, as after a power cut.
+
+   Each device publishes to its own channel, and one monitor connection
+   subscribed to channels/+/publish times every sensor publish from send to
+   delivery. The readings are synthetic; pm1 carries a per-device sequence
+   number so deliveries can be matched even when some are lost. The monitor
+   is a single connection, so on a big fleet check that it keeps up
+   (received close to sent) before trusting the latencies.
+
+   Large fleets need more file descriptors: ulimit -n 20000.
+*/
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../include/publish.h"
+
+#define CONNACK_TIMEOUT_US 10000000
+#define SEQUENCE_WINDOW 64 // sensor publishes a device can have in flight
+#define DRAIN_US 2000000   // wait for late deliveries at the end
+
+struct Options
+{
+  const char *host = "127.0.0.1";
+  int port = 1883;
+  int devices = 1000;
+  int duration_s = 300;
+  double interval_s = PUBLISH_INTERVAL_S;
+  double keep_alive_s = KEEP_ALIVE_INTERVAL_S;
+  bool aligned = true;
+  double jitter = 0.1;
+  int connect_rate = 500;
+  double storm_every_s = 0;
+  double storm_share = 0.5;
+  long channel = 900000;
+  const char *user = "";
+  const char *password = "";
+  double report_s = 10;
+};
+
+enum CONNECTION_STATES
+{
+  CONN_IDLE,
+  CONN_CONNECTING,   // TCP handshake
+  CONN_WAIT_CONNACK,
+  CONN_CONNECTED,
+};
+
+struct Connection
+{
+  int fd = -1;
+  CONNECTION_STATES state = CONN_IDLE;
+  std::string in, out;
+  int64_t started_us = 0;   // of the current connect attempt
+  int64_t last_sent_us = 0; // for PINGREQ
+  int64_t retry_us = 0;     // next connect attempt
+  char client_id[32];
+  int device; // index in devices, -1 for the monitor
+};
+
+struct Device
+{
+  Connection conn;
+  char channel[16];
+  int64_t next_publish_us = 0;
+  int64_t next_keep_alive_us = 0;
+  uint16_t seq = 0;
+  int64_t sent_us[SEQUENCE_WINDOW]; // by seq % SEQUENCE_WINDOW, 0 once delivered
+};
+
+struct Stats
+{
+  uint64_t sensor_sent = 0;
+  uint64_t keep_alive_sent = 0;
+  uint64_t delivered = 0; // sensor publishes seen by the monitor
+  uint64_t blocked = 0;   // dropped because the socket buffer was full
+  uint64_t connect_attempts = 0;
+  uint64_t connected = 0;
+  uint64_t tcp_errors = 0;
+  uint64_t connack_timeouts = 0;
+  uint64_t refused[6] = {}; // by CONNACK return code, [0] unused
+  uint64_t broker_closed = 0;
+  std::vector<uint32_t> latencies_us;
+};
+
+Options options;
+std::vector<Device> devices;
+Connection monitor;
+Stats total, window;
+int epoll_fd;
+sockaddr_storage broker_addr;
+socklen_t broker_addr_len;
+std::mt19937 rng(12345);
+
+int64_t now_us()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int64_t jittered_us(double seconds)
+{
+  std::uniform_real_distribution<double> spread(1 - options.jitter, 1 + options.jitter);
+  return (int64_t)(seconds * spread(rng) * 1e6);
+}
+
+// The wall-clock slot send_mqtt_task would pick, as a now_us() time. Right
+// after a publish it skips slots closer than half the minimum interval.
+int64_t next_slot_us(const Device &device, bool published)
+{
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  int64_t now = now_us();
+  uint64_t wall_ms = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+  uint32_t period_ms = (uint32_t)(options.interval_s * 1000);
+  uint64_t after_ms = wall_ms + (published ? std::min<uint32_t>(PUBLISH_MIN_INTERVAL_S * 500, period_ms / 2) : 0);
+  uint64_t slot_ms = publish_slot_after(after_ms, period_ms, publish_offset_ms(device.conn.client_id, period_ms));
+  return now + (int64_t)(slot_ms - wall_ms) * 1000;
+}
+
+/*
+   MQTT 3.1.1 packets, only the ones PubSubClient uses
+*/
+void put_length(std::string &packet, size_t length)
+{
+  do
+  {
+    uint8_t byte = length % 128;
+    length /= 128;
+    packet += (char)(length ? byte | 0x80 : byte);
+  } while (length);
+}
+
+void put_string(std::string &body, const char *s)
+{
+  size_t n = strlen(s);
+  body += (char)(n >> 8);
+  body += (char)(n & 0xff);
+  body.append(s, n);
+}
+
+std::string packet(uint8_t type, const std::string &body)
+{
+  std::string p(1, (char)type);
+  put_length(p, body.size());
+  return p + body;
+}
+
+std::string connect_packet(const char *client_id)
+{
+  std::string body;
+  put_string(body, "MQTT");
+  body += (char)4; // protocol level 3.1.1
+  uint8_t flags = 0x02; // clean session
+  if (*options.user)
+    flags |= 0x80;
+  if (*options.password)
+    flags |= 0x40;
+  body += (char)flags;
+  body += (char)(MQTT_KEEP_ALIVE_S >> 8);
+  body += (char)(MQTT_KEEP_ALIVE_S & 0xff);
+  put_string(body, client_id);
+  if (*options.user)
+    put_string(body, options.user);
+  if (*options.password)
+    put_string(body, options.password);
+  return packet(0x10, body);
+}
+
+std::string subscribe_packet(const char *topic)
+{
+  std::string body;
+  body += (char)0;
+  body += (char)1; // packet ID
+  put_string(body, topic);
+  body += (char)0; // QoS 0
+  return packet(0x82, body);
+}
+
+std::string publish_packet(const char *topic, const char *payload)
+{
+  std::string body;
+  put_string(body, topic);
+  body += payload;
+  return packet(0x30, body);
+}
+
+// Returns the length of the first whole packet in buffer, 0 if incomplete
+size_t packet_length(const std::string &buffer, size_t &header)
+{
+  size_t length = 0;
+  for (size_t i = 1, shift = 0; i < buffer.size() && i <= 4; i++, shift += 7)
+  {
+    length |= (size_t)((uint8_t)buffer[i] & 0x7f) << shift;
+    if (!((uint8_t)buffer[i] & 0x80))
+    {
+      header = i + 1;
+      return buffer.size() >= header + length ? header + length : 0;
+    }
+  }
+  return 0;
+}
+
+/*
+   Connections
+*/
+void watch(Connection &conn, uint32_t events, bool add)
+{
+  epoll_event ev = {};
+  ev.events = events;
+  ev.data.ptr = &conn;
+  epoll_ctl(epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, conn.fd, &ev);
+}
+
+void close_connection(Connection &conn, int64_t retry_after_us)
+{
+  if (conn.fd >= 0)
+    close(conn.fd);
+  conn.fd = -1;
+  conn.state = CONN_IDLE;
+  conn.in.clear();
+  conn.out.clear();
+  conn.retry_us = now_us() + retry_after_us;
+}
+
+void start_connect(Connection &conn)
+{
+  total.connect_attempts++;
+  window.connect_attempts++;
+  conn.started_us = now_us();
+
+  conn.fd = socket(broker_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  int one = 1;
+  setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (conn.fd < 0 || (connect(conn.fd, (sockaddr *)&broker_addr, broker_addr_len) < 0 && errno != EINPROGRESS))
+  {
+    total.tcp_errors++;
+    window.tcp_errors++;
+    close_connection(conn, MQTT_RETRY_MS * 1000LL);
+    return;
+  }
+  conn.state = CONN_CONNECTING;
+  watch(conn, EPOLLOUT, true);
+}
+
+// Queues bytes behind anything not yet sent; false if the socket is backed up
+bool send_bytes(Connection &conn, const std::string &bytes, bool droppable)
+{
+  if (droppable && !conn.out.empty())
+    return false;
+
+  conn.out += bytes;
+  ssize_t n = send(conn.fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+  if (n > 0)
+    conn.out.erase(0, n);
+  if (!conn.out.empty())
+    watch(conn, EPOLLIN | EPOLLOUT, false);
+  conn.last_sent_us = now_us();
+  return true;
+}
+
+void publish_sensor(Device &device)
+{
+  char topic[64], payload[PUBLISH_PAYLOAD_SIZE];
+  std::uniform_int_distribution<int> humidity(40, 80), temperature(20, 35), dust(5, 120);
+
+  int pm2_5 = dust(rng);
+  PublishReadings readings = {humidity(rng), temperature(rng), device.seq, pm2_5, pm2_5 + 10,
+                              pm2_5 * 2, pm2_5 * 2, pm2_5, pm2_5 < 25 ? "Moderate" : "USG"};
+  format_publish_topic(topic, sizeof(topic), device.channel);
+  format_sensor_payload(payload, sizeof(payload), readings);
+
+  if (!send_bytes(device.conn, publish_packet(topic, payload), true))
+  {
+    total.blocked++;
+    window.blocked++;
+    return;
+  }
+  device.sent_us[device.seq % SEQUENCE_WINDOW] = now_us();
+  device.seq = (device.seq + 1) % 10000; // pm1 is at most four digits
+  total.sensor_sent++;
+  window.sensor_sent++;
+}
+
+void publish_keep_alive(Device &device)
+{
+  char topic[64];
+  format_publish_topic(topic, sizeof(topic), device.channel);
+  if (send_bytes(device.conn, publish_packet(topic, KEEP_ALIVE_PAYLOAD), true))
+  {
+    total.keep_alive_sent++;
+    window.keep_alive_sent++;
+  }
+  else
+  {
+    total.blocked++;
+    window.blocked++;
+  }
+}
+
+// Matches a delivery on channels/<n>/publish to the device and sequence number
+void on_delivery(const char *topic, size_t topic_length, const char *payload, size_t payload_length)
+{
+  std::string t(topic, topic_length), p(payload, payload_length);
+  long channel;
+  if (sscanf(t.c_str(), "channels/%ld/publish", &channel) != 1)
+    return;
+  long index = channel - options.channel;
+  size_t field3 = p.find("&field3=");
+  if (index < 0 || index >= (long)devices.size() || field3 == std::string::npos)
+    return; // keep-alives carry no sequence number
+
+  Device &device = devices[index];
+  int seq = atoi(p.c_str() + field3 + 8);
+  int64_t &sent = device.sent_us[seq % SEQUENCE_WINDOW];
+  if (sent == 0)
+    return;
+  uint32_t latency = now_us() - sent;
+  sent = 0;
+  total.delivered++;
+  window.delivered++;
+  total.latencies_us.push_back(latency);
+  window.latencies_us.push_back(latency);
+}
+
+void on_connected(Connection &conn)
+{
+  total.connected++;
+  window.connected++;
+  conn.state = CONN_CONNECTED;
+
+  if (conn.device < 0)
+  {
+    send_bytes(conn, subscribe_packet("channels/+/publish"), false);
+    return;
+  }
+
+  // Same order as a booting clock: command topic, sensor publish, keep-alive
+  Device &device = devices[conn.device];
+  char topic[64];
+  snprintf(topic, sizeof(topic), "channels/%s/subscribe/fields/field7", device.channel);
+  send_bytes(conn, subscribe_packet(topic), false);
+  if (!options.aligned)
+    publish_sensor(device);
+  publish_keep_alive(device);
+  device.next_publish_us = options.aligned ? next_slot_us(device, false) : now_us() + jittered_us(options.interval_s);
+  device.next_keep_alive_us = now_us() + jittered_us(options.keep_alive_s);
+}
+
+void on_readable(Connection &conn)
+{
+  char buffer[4096];
+  for (;;)
+  {
+    ssize_t n = recv(conn.fd, buffer, sizeof(buffer), 0);
+    if (n > 0)
+    {
+      conn.in.append(buffer, n);
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+
+    // Closed by the broker, or reset
+    if (conn.state == CONN_CONNECTED)
+    {
+      total.broker_closed++;
+      window.broker_closed++;
+    }
+    else
+    {
+      total.tcp_errors++;
+      window.tcp_errors++;
+    }
+    close_connection(conn, MQTT_RETRY_MS * 1000LL);
+    return;
+  }
+
+  size_t header, length;
+  while ((length = packet_length(conn.in, header)) > 0)
+  {
+    uint8_t type = (uint8_t)conn.in[0] & 0xf0;
+    const char *body = conn.in.data() + header;
+    size_t body_length = length - header;
+
+    if (type == 0x20 && conn.state == CONN_WAIT_CONNACK && body_length >= 2)
+    {
+      uint8_t rc = body[1];
+      if (rc == 0)
+      {
+        on_connected(conn);
+      }
+      else
+      {
+        total.refused[rc < 6 ? rc : 5]++;
+        window.refused[rc < 6 ? rc : 5]++;
+        close_connection(conn, MQTT_RETRY_MS * 1000LL);
+        return;
+      }
+    }
+    else if (type == 0x30 && conn.device < 0 && body_length >= 2)
+    {
+      size_t topic_length = ((uint8_t)body[0] << 8) | (uint8_t)body[1];
+      if (2 + topic_length <= body_length)
+        on_delivery(body + 2, topic_length, body + 2 + topic_length, body_length - 2 - topic_length);
+    }
+    conn.in.erase(0, length);
+  }
+}
+
+void on_writable(Connection &conn)
+{
+  if (conn.state == CONN_CONNECTING)
+  {
+    int error = 0;
+    socklen_t size = sizeof(error);
+    getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &size);
+    if (error)
+    {
+      total.tcp_errors++;
+      window.tcp_errors++;
+      close_connection(conn, MQTT_RETRY_MS * 1000LL);
+      return;
+    }
+    conn.state = CONN_WAIT_CONNACK;
+    watch(conn, EPOLLIN, false);
+    send_bytes(conn, connect_packet(conn.client_id), false);
+    return;
+  }
+
+  ssize_t n = send(conn.fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+  if (n > 0)
+    conn.out.erase(0, n);
+  if (conn.out.empty())
+    watch(conn, EPOLLIN, false);
+}
+
+// Connect timeouts, keep-alive pings and, for devices, the publish schedule
+void service(Connection &conn, Device *device, int64_t now)
+{
+  if (conn.state == CONN_IDLE)
+  {
+    if (now >= conn.retry_us)
+      start_connect(conn);
+    return;
+  }
+
+  if (conn.state != CONN_CONNECTED)
+  {
+    if (now - conn.started_us > CONNACK_TIMEOUT_US)
+    {
+      total.connack_timeouts++;
+      window.connack_timeouts++;
+      close_connection(conn, MQTT_RETRY_MS * 1000LL);
+    }
+    return;
+  }
+
+  if (device && now >= device->next_publish_us)
+  {
+    publish_sensor(*device);
+    if (options.aligned)
+      device->next_publish_us = next_slot_us(*device, true);
+    else
+      device->next_publish_us += jittered_us(options.interval_s);
+  }
+  if (device && now >= device->next_keep_alive_us)
+  {
+    publish_keep_alive(*device);
+    device->next_keep_alive_us += jittered_us(options.keep_alive_s);
+  }
+  if (now - conn.last_sent_us >= MQTT_KEEP_ALIVE_S * 1000000LL)
+    send_bytes(conn, std::string("\xc0\x00", 2), false);
+}
+
+/*
+   Reports
+*/
+uint32_t percentile(std::vector<uint32_t> &sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+  size_t i = std::min(sorted.size() - 1, (size_t)(p / 100 * sorted.size()));
+  return sorted[i];
+}
+
+uint64_t refused(const Stats &s)
+{
+  uint64_t n = 0;
+  for (int rc = 1; rc < 6; rc++)
+    n += s.refused[rc];
+  return n;
+}
+
+int connected_devices()
+{
+  int n = 0;
+  for (Device &device : devices)
+    n += device.conn.state == CONN_CONNECTED;
+  return n;
+}
+
+void print_window(double elapsed_s, double window_s)
+{
+  std::sort(window.latencies_us.begin(), window.latencies_us.end());
+  printf("%6.0fs  connected %6d  sent %8.1f/s  delivered %8.1f/s  p50 %7.2f ms  p99 %7.2f ms  "
+         "refused %llu  tcp errors %llu  timeouts %llu  closed %llu  blocked %llu\n",
+         elapsed_s, connected_devices(), window.sensor_sent / window_s, window.delivered / window_s,
+         percentile(window.latencies_us, 50) / 1000.0, percentile(window.latencies_us, 99) / 1000.0,
+         (unsigned long long)refused(window), (unsigned long long)window.tcp_errors,
+         (unsigned long long)window.connack_timeouts, (unsigned long long)window.broker_closed,
+         (unsigned long long)window.blocked);
+  fflush(stdout);
+  window = Stats();
+}
+
+void print_summary(double elapsed_s)
+{
+  std::vector<uint32_t> &l = total.latencies_us;
+  std::sort(l.begin(), l.end());
+  uint64_t lost = total.sensor_sent - total.delivered;
+  uint64_t rejected = refused(total) + total.tcp_errors + total.connack_timeouts;
+
+  printf("\n%d devices for %.0f s against %s:%d\n", options.devices, elapsed_s, options.host, options.port);
+  printf("publishes     %llu sensor (%.1f/s), %llu keep-alive (%.1f/s)\n",
+         (unsigned long long)total.sensor_sent, total.sensor_sent / elapsed_s,
+         (unsigned long long)total.keep_alive_sent, total.keep_alive_sent / elapsed_s);
+  printf("delivered     %llu (%.1f/s), lost %llu (%.3f%%), blocked by a full socket %llu\n",
+         (unsigned long long)total.delivered, total.delivered / elapsed_s, (unsigned long long)lost,
+         total.sensor_sent ? 100.0 * lost / total.sensor_sent : 0.0, (unsigned long long)total.blocked);
+  printf("latency ms    p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+         percentile(l, 50) / 1000.0, percentile(l, 90) / 1000.0, percentile(l, 99) / 1000.0,
+         percentile(l, 99.9) / 1000.0, l.empty() ? 0.0 : l.back() / 1000.0);
+  printf("connects      %llu attempted, %llu accepted, %llu rejected (%.3f%%)\n",
+         (unsigned long long)total.connect_attempts, (unsigned long long)total.connected, (unsigned long long)rejected,
+         total.connect_attempts ? 100.0 * rejected / total.connect_attempts : 0.0);
+  printf("  refused     rc1 protocol %llu, rc2 client ID %llu, rc3 unavailable %llu, rc4 credentials %llu, rc5 not authorized %llu\n",
+         (unsigned long long)total.refused[1], (unsigned long long)total.refused[2], (unsigned long long)total.refused[3],
+         (unsigned long long)total.refused[4], (unsigned long long)total.refused[5]);
+  printf("  tcp errors  %llu, CONNACK timeouts %llu\n",
+         (unsigned long long)total.tcp_errors, (unsigned long long)total.connack_timeouts);
+  printf("disconnected  %llu times by the broker\n", (unsigned long long)total.broker_closed);
+}
+
+/*
+   Main loop
+*/
+void parse_options(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const char *name = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!value)
+    {
+      fprintf(stderr, "missing value for %s\n", name);
+      exit(2);
+    }
+    i++;
+
+    if (!strcmp(name, "--host"))
+      options.host = value;
+    else if (!strcmp(name, "--port"))
+      options.port = atoi(value);
+    else if (!strcmp(name, "--devices"))
+      options.devices = atoi(value);
+    else if (!strcmp(name, "--duration"))
+      options.duration_s = atoi(value);
+    else if (!strcmp(name, "--interval"))
+      options.interval_s = atof(value);
+    else if (!strcmp(name, "--keep-alive"))
+      options.keep_alive_s = atof(value);
+    else if (!strcmp(name, "--schedule"))
+      options.aligned = strcmp(value, "boot") != 0;
+    else if (!strcmp(name, "--jitter"))
+      options.jitter = atof(value);
+    else if (!strcmp(name, "--connect-rate"))
+      options.connect_rate = atoi(value);
+    else if (!strcmp(name, "--storm-every"))
+      options.storm_every_s = atof(value);
+    else if (!strcmp(name, "--storm-share"))
+      options.storm_share = atof(value);
+    else if (!strcmp(name, "--channel"))
+      options.channel = atol(value);
+    else if (!strcmp(name, "--user"))
+      options.user = value;
+    else if (!strcmp(name, "--password"))
+      options.password = value;
+    else if (!strcmp(name, "--report"))
+      options.report_s = atof(value);
+    else
+    {
+      fprintf(stderr, "unknown option %s, see the comment at the top of tools/fleet_load.cpp\n", name);
+      exit(2);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  parse_options(argc, argv);
+
+  addrinfo hints = {}, *result;
+  hints.ai_socktype = SOCK_STREAM;
+  char port[8];
+  snprintf(port, sizeof(port), "%d", options.port);
+  if (getaddrinfo(options.host, port, &hints, &result) != 0)
+  {
+    fprintf(stderr, "cannot resolve %s\n", options.host);
+    return 1;
+  }
+  memcpy(&broker_addr, result->ai_addr, result->ai_addrlen);
+  broker_addr_len = result->ai_addrlen;
+  freeaddrinfo(result);
+
+  epoll_fd = epoll_create1(0);
+  int64_t start = now_us();
+
+  // Devices come up at connect_rate per second, like a fleet after a power cut
+  devices.resize(options.devices);
+  for (int i = 0; i < options.devices; i++)
+  {
+    Device &device = devices[i];
+    snprintf(device.channel, sizeof(device.channel), "%ld", options.channel + i);
+    snprintf(device.conn.client_id, sizeof(device.conn.client_id), "fleet-%ld", options.channel + i);
+    memset(device.sent_us, 0, sizeof(device.sent_us));
+    device.conn.device = i;
+    device.conn.retry_us = start + i * 1000000LL / std::max(1, options.connect_rate);
+  }
+  snprintf(monitor.client_id, sizeof(monitor.client_id), "fleet-monitor");
+  monitor.device = -1;
+  start_connect(monitor);
+
+  int64_t end = start + options.duration_s * 1000000LL;
+  int64_t next_report = start + (int64_t)(options.report_s * 1e6);
+  int64_t next_storm = options.storm_every_s > 0 ? start + (int64_t)(options.storm_every_s * 1e6) : INT64_MAX;
+  int64_t last_report = start;
+  std::vector<epoll_event> events(1024);
+
+  for (int64_t now = start; now < end + DRAIN_US; now = now_us())
+  {
+    int n = epoll_wait(epoll_fd, events.data(), events.size(), 5);
+    for (int i = 0; i < n; i++)
+    {
+      Connection &conn = *(Connection *)events[i].data.ptr;
+      if (conn.fd < 0)
+        continue;
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        on_readable(conn);
+      if (conn.fd >= 0 && (events[i].events & EPOLLOUT))
+        on_writable(conn);
+    }
+
+    now = now_us();
+    service(monitor, NULL, now);
+    if (now < end)
+    {
+      for (Device &device : devices)
+        service(device.conn, &device, now);
+    }
+
+    if (now >= next_storm && now < end)
+    {
+      int dropped = 0;
+      std::uniform_real_distribution<double> share(0, 1);
+      for (Device &device : devices)
+        if (device.conn.state == CONN_CONNECTED && share(rng) < options.storm_share)
+        {
+          close_connection(device.conn, 0);
+          dropped++;
+        }
+      printf("storm: %d devices reconnecting\n", dropped);
+      next_storm += (int64_t)(options.storm_every_s * 1e6);
+    }
+
+    if (now >= next_report)
+    {
+      print_window((now - start) / 1e6, (now - last_report) / 1e6);
+      last_report = now;
+      next_report += (int64_t)(options.report_s * 1e6);
+    }
+  }
+
+  print_summary(options.duration_s);
+  return 0;
+}
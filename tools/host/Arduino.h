@@ -0,0 +1,16 @@
+/*
+   The little of the Arduino core that arduino-fsm needs, so tools/bench.cpp
+   can build the real library on the host.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+inline unsigned long millis()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
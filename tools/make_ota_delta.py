@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""Builds a delta OTA image for the alarm clock.
+
+Usage: make_ota_delta.py <running firmware.bin> <new firmware.bin> <out.delta>
+
+Serve the output over HTTP at the OTA_URL the running firmware was built with.
+The format is read by ota_check() in src/main.cpp:
+
+    header  magic "ADLT", base size, base MD5, target size, target MD5
+    body    zlib stream of operations
+              'C' <u32 offset> <u32 length>  copy from the running image
+              'A' <u32 length> <bytes>       literal bytes
+              'E'                            end
+"""
+
+import hashlib
+import struct
+import sys
+import zlib
+
+BLOCK = 32  # shortest run worth a COPY
+
+
+def diff(base, target):
+    index = {}
+    for offset in range(0, len(base) - BLOCK + 1, 4):
+        index.setdefault(base[offset:offset + BLOCK], offset)
+
+    ops = bytearray()
+    literal = bytearray()
+
+    def flush_literal():
+        if literal:
+            ops.extend(b"A" + struct.pack("<I", len(literal)) + literal)
+            literal.clear()
+
+    i = 0
+    while i < len(target):
+        source = index.get(target[i:i + BLOCK])
+        if source is None:
+            literal.append(target[i])
+            i += 1
+            continue
+
+        length = BLOCK
+        while (i + length < len(target) and source + length < len(base)
+               and target[i + length] == base[source + length]):
+            length += 1
+
+        flush_literal()
+        ops.extend(b"C" + struct.pack("<II", source, length))
+        i += length
+
+    flush_literal()
+    ops.extend(b"E")
+    return bytes(ops)
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit(__doc__)
+
+    base = open(sys.argv[1], "rb").read()
+    target = open(sys.argv[2], "rb").read()
+
+    header = struct.pack("<4sI16sI16s", b"ADLT", len(base), hashlib.md5(base).digest(),
+                         len(target), hashlib.md5(target).digest())
+    body = zlib.compress(diff(base, target), 9)
+
+    with open(sys.argv[3], "wb") as out:
+        out.write(header + body)
+
+    print(f"{len(target)} byte image -> {len(header) + len(body)} byte delta")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,222 @@
+#!/usr/bin/env python3
+"""Reports where the alarm clock's flash and RAM go, and checks a size budget.
+
+Usage: size_report.py [--top N] [--budget FILE] [--update] <firmware.map>
+
+The map file is written by the linker flag in platformio.ini, at
+.pio/build/esp32dev/firmware.map. Sizes are counted per input section, which
+with -ffunction-sections and -fdata-sections is one per symbol:
+
+    flash  code and constants in flash, plus the initial image of IRAM code
+           and initialised data
+    ram    IRAM code, initialised data and .bss
+
+Modules are the object file for project code and the archive for libraries
+and the framework. The budget is JSON:
+
+    {"total": {"flash": 1000000, "ram": 120000},
+     "modules": {"main.cpp.o": {"flash": 90000, "ram": 60000}}}
+
+A run with --budget exits 1 if any total or module is over its budget.
+--update rewrites the budget from this build with BUDGET_HEADROOM to spare,
+so commit it after a change that is meant to grow the firmware.
+"""
+
+import argparse
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+
+BUDGET_HEADROOM = 0.05
+
+# ESP32 address map
+REGIONS = [
+    (0x3F400000, 0x3F800000, "drom"),
+    (0x3FF80000, 0x40000000, "dram"),
+    (0x40070000, 0x400C0000, "iram"),
+    (0x400C2000, 0x40C00000, "irom"),
+    (0x50000000, 0x50002000, "rtc"),
+]
+
+OUTPUT_SECTION = re.compile(r"^(\.\S+)\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)")
+INPUT_SECTION = re.compile(r"^ (\.\S+|COMMON)(?:\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*))?$")
+CONTINUATION = re.compile(r"^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*)$")
+SYMBOL = re.compile(r"^\s+0x([0-9a-f]+)\s+([^\s=]+)$")
+
+
+def region(address):
+    for start, end, name in REGIONS:
+        if start <= address < end:
+            return name
+    return None
+
+
+def cost(address, size, section):
+    """Returns (flash, ram) bytes for an input section."""
+    where = region(address)
+    uninitialised = section.startswith((".bss", "COMMON", ".noinit", ".rtc_noinit"))
+    if where in ("drom", "irom"):
+        return size, 0
+    if where in ("dram", "iram", "rtc"):
+        return (0 if uninitialised else size), size
+    return 0, 0
+
+
+def module(path):
+    path = path.strip()
+    archive = re.match(r"(.*\.a)\((.*)\)$", path)
+    if archive:
+        return os.path.basename(archive.group(1))
+    return os.path.basename(path)
+
+
+def symbol(section):
+    """Returns the symbol a section is named after, or None for sections like .iram1.3."""
+    for prefix in (".text.", ".literal.", ".rodata.", ".data.", ".bss.", ".iram1.", ".dram1.", ".sbss.", ".sdata."):
+        if section.startswith(prefix) and len(section) > len(prefix):
+            name = section[len(prefix):]
+            return None if name.isdigit() else name
+    return None
+
+
+def parse(lines):
+    """Yields (symbol, module, flash, ram) for every input section in the memory map."""
+    in_map = False
+    pending = None  # section whose address and size are on the next line
+    entry = None    # [name, module, flash, ram, address], waiting for a symbol line to name it
+    for line in lines:
+        line = line.rstrip("\n")
+        if not in_map:
+            in_map = line.startswith("Linker script and memory map")
+            continue
+        if line.startswith("/DISCARD/"):
+            break
+        section = None
+        match = CONTINUATION.match(line) if pending is not None else None
+        if match:
+            section, pending = pending, None
+            address, size, path = int(match.group(1), 16), int(match.group(2), 16), match.group(3)
+        else:
+            pending = None
+            match = SYMBOL.match(line)
+            if match:
+                if entry and entry[0] is None and int(match.group(1), 16) == entry[4]:
+                    entry[0] = match.group(2)
+                continue
+            match = INPUT_SECTION.match(line)
+            if not match:
+                if OUTPUT_SECTION.match(line) or line.startswith(" *fill*"):
+                    if entry:
+                        yield tuple(entry[:4])
+                    entry = None
+                continue
+            if match.group(2) is None:
+                pending = match.group(1)  # the name was too long, the rest is on the next line
+                continue
+            section = match.group(1)
+            address, size, path = int(match.group(2), 16), int(match.group(3), 16), match.group(4)
+        if entry:
+            yield tuple(entry[:4])
+        entry = None
+        if size and address:
+            flash, ram = cost(address, size, section)
+            entry = [symbol(section), module(path), flash, ram, address]
+            if entry[0] is None and section == "COMMON":
+                entry[0] = "COMMON"
+    if entry:
+        yield tuple(entry[:4])
+
+
+def demangle(names):
+    tool = shutil.which("xtensa-esp32-elf-c++filt") or shutil.which("c++filt")
+    if not tool or not names:
+        return {name: name for name in names}
+    result = subprocess.run([tool], input="\n".join(names), capture_output=True, text=True)
+    out = result.stdout.split("\n")
+    return {name: (out[i] if i < len(out) and out[i] else name) for i, name in enumerate(names)}
+
+
+def table(title, rows, top):
+    print(title)
+    print("  %8s %8s  %s" % ("flash", "ram", "name"))
+    for name, (flash, ram) in rows[:top]:
+        print("  %8d %8d  %s" % (flash, ram, name))
+    print()
+
+
+def check(budget, total, modules):
+    over = []
+    for kind in ("flash", "ram"):
+        limit = budget.get("total", {}).get(kind)
+        if limit is not None and total[kind] > limit:
+            over.append("total %s %d > %d" % (kind, total[kind], limit))
+    for name, limits in budget.get("modules", {}).items():
+        flash, ram = modules.get(name, (0, 0))
+        for kind, value in (("flash", flash), ("ram", ram)):
+            limit = limits.get(kind)
+            if limit is not None and value > limit:
+                over.append("%s %s %d > %d" % (name, kind, value, limit))
+    return over
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Flash and RAM size report for the alarm clock")
+    parser.add_argument("map", help="linker map file")
+    parser.add_argument("--top", type=int, default=25, help="rows per table")
+    parser.add_argument("--budget", help="budget JSON to check against")
+    parser.add_argument("--update", action="store_true", help="rewrite the budget from this build")
+    args = parser.parse_args()
+
+    symbols = {}
+    modules = {}
+    with open(args.map) as f:
+        for name, owner, flash, ram in parse(f):
+            name = name or "(unnamed)"
+            key = (name, owner)
+            s = symbols.get(key, (0, 0))
+            symbols[key] = (s[0] + flash, s[1] + ram)
+            m = modules.get(owner, (0, 0))
+            modules[owner] = (m[0] + flash, m[1] + ram)
+
+    total = {"flash": sum(m[0] for m in modules.values()), "ram": sum(m[1] for m in modules.values())}
+    print("total  flash %d  ram %d\n" % (total["flash"], total["ram"]))
+
+    names = demangle(sorted({name for name, _ in symbols}))
+    by_flash = sorted(modules.items(), key=lambda item: -item[1][0])
+    by_ram = sorted(modules.items(), key=lambda item: -item[1][1])
+    table("modules by flash", by_flash, args.top)
+    table("modules by ram", by_ram, args.top)
+    rows = [("%s  [%s]" % (names[name], owner), size) for (name, owner), size in symbols.items()]
+    table("symbols by flash", sorted(rows, key=lambda item: -item[1][0]), args.top)
+    table("symbols by ram", sorted(rows, key=lambda item: -item[1][1]), args.top)
+
+    if not args.budget:
+        return 0
+    if args.update:
+        def headroom(value):
+            return int(value * (1 + BUDGET_HEADROOM))
+        budget = {
+            "total": {kind: headroom(value) for kind, value in total.items()},
+            "modules": {name: {"flash": headroom(flash), "ram": headroom(ram)}
+                        for name, (flash, ram) in by_flash[:args.top]},
+        }
+        with open(args.budget, "w") as f:
+            json.dump(budget, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("budget written to %s" % args.budget)
+        return 0
+
+    with open(args.budget) as f:
+        over = check(json.load(f), total, modules)
+    for line in over:
+        print("OVER BUDGET: %s" % line)
+    if not over:
+        print("within budget")
+    return 1 if over else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+"""Decodes the binary serial telemetry of the alarm clock into CSV files.
+
+Usage: telemetry_decode.py <capture file or serial port> [output directory]
+
+Build the firmware with -D SERIAL_TELEMETRY. Either capture the port first
+(for example `cat /dev/ttyUSB0 > capture.bin` after `stty -F /dev/ttyUSB0 921600 raw`)
+or pass the port directly, which needs pyserial and stops on Ctrl-C.
+Writes sensors.csv, ticks.csv, events.csv and publishes.csv. Text log lines between frames
+are skipped, and frames that fail the CRC are counted and dropped.
+
+Frame layout, see "Serial telemetry" in src/main.cpp:
+
+    0xA5 0x5A | type u8 | length u8 | micros u32 | payload | CRC-16/CCITT u16
+"""
+
+import csv
+import os
+import struct
+import sys
+
+SYNC = b"\xa5\x5a"
+OVERHEAD = 10
+
+STATES = ["MAIN", "MENU_SET_ALARM", "MENU_SET_TIME", "MENU_SET_DATE", "SET_HOUR", "SET_MINUTE",
+          "SET_DAY", "SET_MONTH", "SET_YEAR", "SET_ALARM_HOUR", "SET_ALARM_MINUTE",
+          "SET_ALARM_ON_OFF", "ALARM_TIME", "SENSOR"]
+EVENTS = ["boot", "state", "button", "wifi_lost", "mqtt_lost", "mqtt_connected", "publish_failed",
+          "i2c_error", "sensor_error", "task_stall", "task_restart", "reboot"]
+
+# A sensor frame is sent for every record a driver returns: the driver,
+# the AQI and then one value per quantity slot, in the order the firmware
+# registers its sensor drivers. Drivers and slots past the default ones are
+# named by number.
+DRIVERS = ["dht22", "pms7003"]
+QUANTITIES = ["humidity", "temperature", "pm1", "pm2_5", "pm10", "q5", "q6", "q7"]
+MISSING = -32768  # SENSOR_MISSING, no reading yet
+
+
+def sensor_row(values):
+    driver = DRIVERS[values[0]] if values[0] < len(DRIVERS) else values[0]
+    row = [driver] + ["" if v == MISSING else v for v in values[1:]]
+    return row + [""] * (2 + len(QUANTITIES) - len(row))
+
+
+# type: (file, header, struct format or None for a list of int16, row builder)
+TYPES = {
+    0: ("sensors.csv", ["time_us", "driver", "aqi"] + QUANTITIES, None, sensor_row),
+    1: ("ticks.csv", ["time_us", "period_us", "run_us", "state"], "<IIB",
+        lambda v: [v[0], v[1], STATES[v[2]] if v[2] < len(STATES) else v[2]]),
+    2: ("events.csv", ["time_us", "event", "arg"], "<BB",
+        lambda v: [EVENTS[v[0]] if v[0] < len(EVENTS) else v[0], v[1]]),
+    3: ("publishes.csv", ["time_us", "ok", "duration_ms"], "<BH",
+        lambda v: list(v)),
+}
+
+
+def crc16_ccitt(data, crc=0xFFFF):
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+class Decoder:
+    def __init__(self, directory):
+        self.buffer = bytearray()
+        self.writers = {}
+        self.files = []
+        self.directory = directory
+        self.frames = 0
+        self.bad_crc = 0
+        self.last_micros = None
+        self.wraps = 0
+
+    def writer(self, frame_type):
+        if frame_type not in self.writers:
+            name, header = TYPES[frame_type][:2]
+            out = open(os.path.join(self.directory, name), "w", newline="")
+            self.files.append(out)
+            self.writers[frame_type] = csv.writer(out)
+            self.writers[frame_type].writerow(header)
+        return self.writers[frame_type]
+
+    # micros() wraps every 71 minutes. Frames from the two cores can arrive
+    # a few microseconds out of order, so only a drop of more than half the
+    # range is a wrap, and a jump forward of more than half the range is a
+    # late frame from before the last wrap.
+    def unwrap(self, micros):
+        if self.last_micros is None:
+            self.last_micros = micros
+        elif self.last_micros - micros > 1 << 31:
+            self.wraps += 1
+            self.last_micros = micros
+        elif micros - self.last_micros > 1 << 31 and self.wraps:
+            return (self.wraps - 1) << 32 | micros
+        elif micros - self.last_micros > 1 << 31:
+            self.last_micros = micros
+        else:
+            self.last_micros = max(self.last_micros, micros)
+        return self.wraps << 32 | micros
+
+    def feed(self, data):
+        self.buffer.extend(data)
+        while True:
+            start = self.buffer.find(SYNC)
+            if start < 0:
+                del self.buffer[:-1]
+                return
+            del self.buffer[:start]
+            if len(self.buffer) < OVERHEAD:
+                return
+
+            frame_type, length = self.buffer[2], self.buffer[3]
+            size = length + OVERHEAD
+            if len(self.buffer) < size:
+                return
+
+            body = bytes(self.buffer[2:size - 2])
+            (crc,) = struct.unpack_from("<H", self.buffer, size - 2)
+            if crc != crc16_ccitt(body) or frame_type not in TYPES:
+                self.bad_crc += 1
+                del self.buffer[:1]  # resync on the next sync word
+                continue
+
+            (micros,) = struct.unpack_from("<I", body, 2)
+            fmt, build = TYPES[frame_type][2:]
+            fmt = fmt or "<B%dh" % ((length - 1) // 2)
+            if struct.calcsize(fmt) == length:
+                values = struct.unpack(fmt, body[6:])
+                self.writer(frame_type).writerow([self.unwrap(micros)] + build(values))
+                self.frames += 1
+            del self.buffer[:size]
+
+    def close(self):
+        for out in self.files:
+            out.close()
+
+
+def open_input(path):
+    if os.path.isfile(path):
+        return open(path, "rb")
+    import serial  # only needed for live capture
+    return serial.Serial(path, 921600, timeout=0.5)
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit(__doc__)
+
+    directory = sys.argv[2] if len(sys.argv) == 3 else "."
+    os.makedirs(directory, exist_ok=True)
+    decoder = Decoder(directory)
+    source = open_input(sys.argv[1])
+
+    try:
+        while True:
+            data = source.read(4096)
+            if not data:
+                if os.path.isfile(sys.argv[1]):
+                    break
+                continue
+            decoder.feed(data)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        decoder.close()
+
+    print(f"{decoder.frames} frames decoded, {decoder.bad_crc} rejected", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()